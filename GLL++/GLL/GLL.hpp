@@ -8,8 +8,11 @@
 #ifndef OPENGLWRAPPER_HPP_
 #define OPENGLWRAPPER_HPP_
 
+#include <cstdint>
 #include <cstdlib>
 #include <iostream>
+#include <string>
+#include <utility>
 #include <vector>
 #include "glbinding/gl/gl.h"
 #include "glbinding/Binding.h"
@@ -27,6 +30,30 @@ inline void init()
     glbinding::Binding::initialize();
 }
 
+/// To be called after the context was made current on another thread
+inline void useCurrentContext()
+{
+	glbinding::Binding::useCurrentContext();
+}
+
+inline bool hasVersion(int major, int minor)
+{
+	GLint contextMajor = 0, contextMinor = 0;
+	glGetIntegerv(GL_MAJOR_VERSION, &contextMajor);
+	glGetIntegerv(GL_MINOR_VERSION, &contextMinor);
+	return contextMajor > major || (contextMajor == major && contextMinor >= minor);
+}
+
+inline bool hasExtension(std::string const &name)
+{
+	GLint count = 0;
+	glGetIntegerv(GL_NUM_EXTENSIONS, &count);
+	for (GLint i = 0; i < count; ++i)
+		if (name == reinterpret_cast<char const *>(glGetStringi(GL_EXTENSIONS, i)))
+			return true;
+	return false;
+}
+
 inline void setDepthTest(bool enabled, GLenum func = GL_LEQUAL)
 {
 	(enabled ?glEnable :glDisable)(GL_DEPTH_TEST);
@@ -74,5 +101,6 @@ struct OpenGLType<char>
 #include "Program.hpp"
 #include "Buffer.hpp"
 #include "VertexArray.hpp"
+#include "StreamBuffer.hpp"
 
 #endif /* OPENGLWRAPPER_HPP_ */
@@ -11,12 +11,29 @@
 namespace gll
 {
 
+/// A shader program.
+///
+/// The shaders are compiled in link(). If a binary cache is set, link() first
+/// looks for a program binary (glProgramBinary, GL 4.1 or
+/// GL_ARB_get_program_binary) in the file
+/// <cache prefix><hash>.glbin, where the hash covers the shader sources,
+/// the attribute names and the GL vendor, renderer and version. If it is
+/// missing or the driver rejects it, the shaders are compiled and linked
+/// and the binary is written for the next start.
 class Program
 {
 private:
 	GLuint program;
 	bool dirty;
 	GLuint currentAttr;
+	std::vector<std::pair<GLenum, std::string>> shaderSources;
+	std::vector<std::string> attributeNames;
+	std::string binaryCache;
+
+	uint64_t binaryKey() const;
+	bool loadBinary(std::string const &filename);
+	void saveBinary(std::string const &filename);
+	void compileAndLink();
 
 	void checkDirty(std::string msg)
 	{
@@ -31,6 +48,16 @@ public:
 		program = glCreateProgram();
 		dirty = true;
 		currentAttr = 0;
+		shaderSources.clear();
+		attributeNames.clear();
+		binaryCache.clear();
+	}
+
+	/// Enable the binary cache, to be called before link(). The files are named
+	/// prefix + hash + ".glbin", the directory of the prefix has to exist.
+	void setBinaryCache(std::string prefix)
+	{
+		binaryCache = prefix;
 	}
 
 	void destroy()
@@ -38,11 +65,14 @@ public:
 		glDeleteProgram(program);
 	}
 
-	void addShader(GLenum type, std::string src, bool isFile);
+	/// defines: lines inserted after the #version line, e.g. "#define X\n"
+	void addShader(GLenum type, std::string src, bool isFile,
+		       std::string const &defines = std::string());
 
 	Attribute getAttribute(std::string name)
 	{
 		glBindAttribLocation(program, currentAttr, name.c_str());
+		attributeNames.push_back(name);
 		dirty = true;
 		return currentAttr++;
 	}
@@ -0,0 +1,78 @@
+/*
+ * StreamBuffer.hpp
+ *
+ *  Streaming of per-frame data (e.g. instance attributes) to the GPU.
+ */
+
+#ifndef STREAMBUFFER_HPP_
+#define STREAMBUFFER_HPP_
+
+namespace gll
+{
+
+/// A buffer that is rewritten every frame.
+///
+/// If the context supports GL_ARB_buffer_storage (GL 4.4), the buffer is a ring
+/// of three regions, mapped once, persistently and coherently. Every frame
+/// writes into the next region, directly, without staging copy. A fence after
+/// the draws of a frame guards its region, so the CPU only waits if it gets
+/// three frames ahead of the GPU.
+/// Otherwise, the buffer is orphaned and mapped anew every frame,
+/// which lets the driver hand out fresh memory without synchronizing.
+///
+/// A GL_TEXTURE_BUFFER is only made persistent if glTexBufferRange (GL 4.3 or
+/// GL_ARB_texture_buffer_range) is there to point the texture at the region.
+///
+/// Usage per frame: map(), write, unmap() -> offset of the data in the buffer,
+/// draw from that offset, fence().
+class StreamBuffer
+{
+private:
+	static constexpr int regionCount = 3;
+	/// Regions start at multiples of this (covers GL_TEXTURE_BUFFER_OFFSET_ALIGNMENT)
+	static constexpr GLsizeiptr regionAlignment = 256;
+
+	GLuint buffer;
+	GLenum target;
+	GLsizeiptr regionSize;
+	bool persistent;
+	char *mapped;
+	GLsync fences[regionCount];
+	int region;
+
+public:
+	/// regionSize: the most bytes written in one frame
+	void create(GLenum target, GLsizeiptr regionSize, bool allowPersistent = true);
+	void destroy();
+
+	/// Start writing the data of the next frame, at most regionSize bytes
+	void *map();
+	/// Finish writing, returns the offset of the written data in the buffer
+	GLintptr unmap();
+	/// To be called after the draws that read the data of this frame
+	void fence();
+
+	void bind()
+	{
+		glBindBuffer(target, buffer);
+	}
+
+	GLuint id() const
+	{
+		return buffer;
+	}
+
+	GLsizeiptr capacity() const
+	{
+		return regionSize;
+	}
+
+	bool isPersistent() const
+	{
+		return persistent;
+	}
+};
+
+}
+
+#endif /* STREAMBUFFER_HPP_ */
@@ -2,28 +2,15 @@
 #include <fstream>
 #include <vector>
 #include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <unistd.h>
 
-void gll::Program::addShader(GLenum type, std::string src, bool isFile)
+/// Compile the shader, exits on errors
+static GLuint compileShader(GLenum type, std::string const &src)
 {
 	using namespace std;
 
-	// load
-	if (isFile)
-	{
-		ifstream ifs(src.c_str(), ios::in | ios::binary | ios::ate);
-		if (!ifs.is_open())
-		{
-			cerr << "ERROR: GLL: Cannot open shader: " << src << "\n";
-			exit(EXIT_FAILURE);
-		}
-		ifstream::pos_type size = ifs.tellg();
-		ifs.seekg(0, ios::beg);
-		vector<char> bytes(size);
-		ifs.read(&bytes[0], size);
-		src = string(&bytes[0], size);
-	}
-
-	// compile
 	GLuint shader = glCreateShader(type);
 	char const *src_c_str = src.c_str();
 	int srclen = src.length();
@@ -43,13 +30,161 @@ void gll::Program::addShader(GLenum type, std::string src, bool isFile)
 		cerr << "GLL: ERROR: Failed to compile " <<  typestr << " shader: " << log << "\n";
 		exit(EXIT_FAILURE);
 	}
+	return shader;
+}
+
+void gll::Program::addShader(GLenum type, std::string src, bool isFile,
+			     std::string const &defines)
+{
+	using namespace std;
+
+	// load
+	if (isFile)
+	{
+		ifstream ifs(src.c_str(), ios::in | ios::binary | ios::ate);
+		if (!ifs.is_open())
+		{
+			cerr << "ERROR: GLL: Cannot open shader: " << src << "\n";
+			exit(EXIT_FAILURE);
+		}
+		ifstream::pos_type size = ifs.tellg();
+		ifs.seekg(0, ios::beg);
+		vector<char> bytes(size);
+		ifs.read(&bytes[0], size);
+		src = string(&bytes[0], size);
+	}
+	if (!defines.empty())
+	{
+		size_t version = src.find("#version");
+		size_t line_end = version == string::npos ?string::npos :src.find('\n', version);
+		if (line_end == string::npos)
+			src = defines + src;
+		else
+			src.insert(line_end + 1, defines);
+	}
 
-	// add
-	glAttachShader(program, shader);
+	// compiled in link(), unless the binary is cached
+	shaderSources.push_back(make_pair(type, src));
 
 	dirty = true;
 }
 
+namespace
+{
+
+/// Header of a program binary cache file, followed by the binary
+struct BinaryHeader
+{
+	char magic[8];
+	uint64_t key;
+	uint32_t format;
+	uint32_t length;
+};
+
+char const binaryMagic[8] = {'G', 'L', 'L', 'P', 'R', 'O', 'G', '1'};
+
+/// FNV-1a
+void hashBytes(uint64_t *hash, void const *data, size_t size)
+{
+	unsigned char const *bytes = static_cast<unsigned char const *>(data);
+	for (size_t i = 0; i < size; ++i)
+	{
+		*hash ^= bytes[i];
+		*hash *= 1099511628211ull;
+	}
+}
+
+void hashString(uint64_t *hash, char const *str)
+{
+	// including the terminator, so that concatenations differ
+	hashBytes(hash, str, strlen(str) + 1);
+}
+
+}  // namespace
+
+uint64_t gll::Program::binaryKey() const
+{
+	uint64_t hash = 14695981039346656037ull;
+	for (auto const &shader : shaderSources)
+	{
+		uint32_t type = static_cast<uint32_t>(shader.first);
+		hashBytes(&hash, &type, sizeof(type));
+		hashString(&hash, shader.second.c_str());
+	}
+	for (auto const &name : attributeNames)
+		hashString(&hash, name.c_str());
+	GLenum driverStrings[3] = {GL_VENDOR, GL_RENDERER, GL_VERSION};
+	for (GLenum name : driverStrings)
+	{
+		char const *str = reinterpret_cast<char const *>(glGetString(name));
+		hashString(&hash, str ?str :"");
+	}
+	return hash;
+}
+
+bool gll::Program::loadBinary(std::string const &filename)
+{
+	FILE *file = fopen(filename.c_str(), "rb");
+	if (!file)
+		return false;
+	BinaryHeader header;
+	std::vector<char> binary;
+	bool ok = fread(&header, sizeof(header), 1, file) == 1
+		&& memcmp(header.magic, binaryMagic, 8) == 0
+		&& header.key == binaryKey();
+	if (ok)
+	{
+		binary.resize(header.length);
+		ok = fread(binary.data(), 1, binary.size(), file) == binary.size();
+	}
+	fclose(file);
+	if (!ok)
+		return false;
+
+	glProgramBinary(program, static_cast<GLenum>(header.format), binary.data(), header.length);
+	GLint status = 0;
+	glGetProgramiv(program, GL_LINK_STATUS, &status);
+	if (!status)
+		std::cout << "GLL: WARNING: Program binary " << filename << " was rejected, recompiling\n";
+	return status;
+}
+
+void gll::Program::saveBinary(std::string const &filename)
+{
+	GLint length = 0;
+	glGetProgramiv(program, GL_PROGRAM_BINARY_LENGTH, &length);
+	if (length <= 0)
+		return;
+	std::vector<char> binary(length);
+	GLenum format;
+	glGetProgramBinary(program, length, 0, &format, binary.data());
+
+	BinaryHeader header;
+	memcpy(header.magic, binaryMagic, 8);
+	header.key = binaryKey();
+	header.format = static_cast<uint32_t>(format);
+	header.length = length;
+
+	// write aside and rename, so that concurrent starts never read a partial file,
+	// the temporary name is unique, so they never write into each other's file either
+	std::string tmpFilename = filename + ".XXXXXX";
+	int fd = mkstemp(&tmpFilename[0]);
+	if (fd < 0)
+		return;
+	FILE *file = fdopen(fd, "wb");
+	if (!file)
+	{
+		close(fd);
+		remove(tmpFilename.c_str());
+		return;
+	}
+	bool ok = fwrite(&header, sizeof(header), 1, file) == 1
+		&& fwrite(binary.data(), 1, binary.size(), file) == binary.size();
+	ok = fclose(file) == 0 && ok;
+	if (!ok || rename(tmpFilename.c_str(), filename.c_str()) != 0)
+		remove(tmpFilename.c_str());
+}
+
 void gll::Program::link()
 {
 	using namespace std;
@@ -57,6 +192,41 @@ void gll::Program::link()
 	if (!dirty)
 		cout << "GLL: WARNING: Program linked unnecessarily\n";
 
+	bool cacheable = !binaryCache.empty()
+		&& (hasVersion(4, 1) || hasExtension("GL_ARB_get_program_binary"));
+	if (cacheable)
+	{
+		GLint formatCount = 0;
+		glGetIntegerv(GL_NUM_PROGRAM_BINARY_FORMATS, &formatCount);
+		cacheable = formatCount > 0;
+	}
+	string cacheFile;
+	if (cacheable)
+	{
+		char key[17];
+		snprintf(key, sizeof(key), "%016llx", static_cast<unsigned long long>(binaryKey()));
+		cacheFile = binaryCache + key + ".glbin";
+		if (loadBinary(cacheFile))
+		{
+			shaderSources.clear();
+			dirty = false;
+			return;
+		}
+		glProgramParameteri(program, GL_PROGRAM_BINARY_RETRIEVABLE_HINT, static_cast<GLint>(GL_TRUE));
+	}
+
+	compileAndLink();
+	if (cacheable)
+		saveBinary(cacheFile);
+	shaderSources.clear();
+	dirty = false;
+}
+
+void gll::Program::compileAndLink()
+{
+	for (auto const &shader : shaderSources)
+		glAttachShader(program, compileShader(shader.first, shader.second));
+
 	glLinkProgram(program);
 
 	int status;
@@ -92,6 +262,4 @@ void gll::Program::link()
 		glDetachShader(program, shaders[i]);
 		glDeleteShader(shaders[i]);
 	}
-
-	dirty = false;
 }
@@ -0,0 +1,91 @@
+#include "GLL/GLL.hpp"
+
+void gll::StreamBuffer::create(GLenum target, GLsizeiptr regionSize, bool allowPersistent)
+{
+	this->target = target;
+	this->regionSize = (regionSize + regionAlignment - 1) / regionAlignment * regionAlignment;
+	persistent = allowPersistent
+		&& (hasVersion(4, 4) || hasExtension("GL_ARB_buffer_storage"))
+		// a texture can only read a region of the ring through glTexBufferRange
+		&& (target != GL_TEXTURE_BUFFER
+		    || hasVersion(4, 3) || hasExtension("GL_ARB_texture_buffer_range"));
+	mapped = 0;
+	region = 0;
+	for (int i = 0; i < regionCount; ++i)
+		fences[i] = 0;
+
+	glGenBuffers(1, &buffer);
+	glBindBuffer(target, buffer);
+	if (persistent)
+	{
+		glBufferStorage(target, this->regionSize * regionCount, 0,
+			GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT);
+		mapped = static_cast<char *>(glMapBufferRange(target, 0, this->regionSize * regionCount,
+			GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT));
+		if (!mapped)
+		{
+			std::cerr << "GLL: WARNING: Cannot map stream buffer persistently, falling back to orphaning\n";
+			glDeleteBuffers(1, &buffer);
+			create(target, regionSize, false);
+		}
+	}
+	else
+		glBufferData(target, this->regionSize, 0, GL_STREAM_DRAW);
+}
+
+void gll::StreamBuffer::destroy()
+{
+	for (int i = 0; i < regionCount; ++i)
+		if (fences[i])
+			glDeleteSync(fences[i]);
+	if (mapped)
+	{
+		glBindBuffer(target, buffer);
+		glUnmapBuffer(target);
+	}
+	glDeleteBuffers(1, &buffer);
+}
+
+void *gll::StreamBuffer::map()
+{
+	if (!persistent)
+	{
+		// orphan the old storage, the driver keeps it alive until the GPU is done with it
+		glBindBuffer(target, buffer);
+		glBufferData(target, regionSize, 0, GL_STREAM_DRAW);
+		return glMapBufferRange(target, 0, regionSize,
+			GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT);
+	}
+
+	region = (region + 1) % regionCount;
+	if (fences[region])
+	{
+		// the GPU might still read this region (only if we are three frames ahead)
+		GLuint64 const timeout = 1000000000;
+		GLenum status;
+		do
+			status = glClientWaitSync(fences[region], GL_SYNC_FLUSH_COMMANDS_BIT, timeout);
+		while (status == GL_TIMEOUT_EXPIRED);
+		glDeleteSync(fences[region]);
+		fences[region] = 0;
+	}
+	return mapped + region * regionSize;
+}
+
+GLintptr gll::StreamBuffer::unmap()
+{
+	if (!persistent)
+	{
+		glBindBuffer(target, buffer);
+		glUnmapBuffer(target);
+		return 0;
+	}
+	// coherent mapping: nothing to flush
+	return region * regionSize;
+}
+
+void gll::StreamBuffer::fence()
+{
+	if (persistent)
+		fences[region] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+}
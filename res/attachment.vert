@@ -0,0 +1,29 @@
+#version 140
+/// quad: x in [-1, 1] across the attachment, y in [0, 1] from body 0 to body 1
+in vec3 vertXYZ;
+in vec2 vertUV;
+/// per instance: indices of the two attached bodies in "bodies"
+in ivec2 instBodies;
+smooth out vec3 fragXYZ;
+smooth out vec2 fragUV;
+flat out vec4 fragOverlayColor;
+flat out float fragTexOffY;
+
+uniform mat4 mvp;
+/// per body: x, y, radius, angle
+uniform samplerBuffer bodies;
+
+void main()
+{
+	vec4 body0 = texelFetch(bodies, instBodies.x);
+	vec4 body1 = texelFetch(bodies, instBodies.y);
+	vec2 sub = body1.xy - body0.xy;
+	float width = min(body0.z, body1.z) * 0.8;
+	vec2 orthsub = normalize(vec2(sub.y, -sub.x)) * width;
+	vec2 xy = body0.xy + orthsub * vertXYZ.x + sub * vertXYZ.y;
+	gl_Position = mvp * vec4(xy, vertXYZ.z, 1);
+	fragXYZ = vertXYZ;
+	fragUV = vertUV;
+	fragOverlayColor = vec4(0, 0, 0, 0);
+	fragTexOffY = 0;
+}
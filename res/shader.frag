@@ -1,15 +1,30 @@
-#version 130
+#version 140
 smooth in vec3 fragXYZ;
 smooth in vec2 fragUV;
+flat in vec4 fragOverlayColor;
+flat in float fragTexOffY;
 out vec4 fragRGBA;
 
 uniform sampler2D tex;
-uniform float tex_off_y;
-uniform vec4 overlay_color;
+/// where the image lies in tex: u, v, width, height
+uniform vec4 texRect;
 
 void main()
 {
-    vec2 tex_off = vec2(0, tex_off_y);
-    fragRGBA = texture(tex, fragUV + tex_off) + overlay_color
-	+ vec4(fragXYZ.z * 0.2, fragXYZ.z * 0.2, fragXYZ.z * 0.2, 0);
+    vec2 tex_off = vec2(0, fragTexOffY);
+    float z = fragXYZ.z;
+#ifdef CIRCLE_MASK
+    // quad LOD: cut the circle out of the quad (xy in [-1, 1]).
+    // Writing the depth turns off early depth tests, so only this program does.
+    float d = length(fragXYZ.xy);
+    if (d > 1)
+	discard;
+    // like the fan: z and depth rise from the center (0) to the edge (1),
+    // the view passes z through
+    z = d;
+    gl_FragDepth = (d + 1) / 2;
+#endif
+    vec2 uv = texRect.xy + (fragUV + tex_off) * texRect.zw;
+    fragRGBA = texture(tex, uv) + fragOverlayColor
+	+ vec4(z * 0.2, z * 0.2, z * 0.2, 0);
 }
@@ -1,14 +1,28 @@
-#version 130
+#version 140
 in vec3 vertXYZ;
 in vec2 vertUV;
+/// per instance: x, y, angle, radius (constant 0, 0, 0, 1 for non-instanced draws)
+in vec4 instPosAngleRadius;
+in vec4 instOverlayColor;
+in float instTexOffY;
 smooth out vec3 fragXYZ;
 smooth out vec2 fragUV;
+flat out vec4 fragOverlayColor;
+flat out float fragTexOffY;
 
 uniform mat4 mvp;
+/// size of a world unit on screen, in pixels, for the point LOD
+uniform float pixelsPerUnit;
 
 void main()
 {
-	gl_Position = mvp * vec4(vertXYZ, 1);
+	float c = cos(instPosAngleRadius.z), s = sin(instPosAngleRadius.z);
+	vec2 xy = mat2(c, s, -s, c) * (vertXYZ.xy * instPosAngleRadius.w)
+		+ instPosAngleRadius.xy;
+	gl_Position = mvp * vec4(xy, vertXYZ.z, 1);
 	fragXYZ = vertXYZ;
 	fragUV = vertUV;
+	fragOverlayColor = instOverlayColor;
+	fragTexOffY = instTexOffY;
+	gl_PointSize = max(2 * instPosAngleRadius.w * pixelsPerUnit, 1);
 }
@@ -0,0 +1,221 @@
+#include "Logger.hpp"
+#include "batch.hpp"
+#include "snapshot/snapshot.hpp"
+#include "snapshot/state_hash.hpp"
+#include "profiler/profiler.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iomanip>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <thread>
+
+namespace
+{
+
+const char *const CELL_TAG_NAMES[CELL_TYPE_TAGS] = {"stem", "muscle", "neuron"};
+
+/// Total mass and center of mass of the bodies
+float mass_center(PhysicsWorld *physics, glm::vec2 *center)
+{
+    float mass = 0;
+    glm::vec2 weighted(0, 0);
+    physics->bodies.for_each([&](Body *body)
+	{
+	    mass+= body->mass;
+	    weighted+= body->mass * body->pos;
+	});
+    *center = mass > 0 ? weighted / mass : glm::vec2(0, 0);
+    return mass;
+}
+
+bool parse_flag(std::string const &value, bool *flag)
+{
+    if (value != "0" && value != "1")
+	return false;
+    *flag = value == "1";
+    return true;
+}
+
+}
+
+WorldSummary run_scenario(BatchScenario const &scenario)
+{
+    WorldSummary summary;
+    summary.name = scenario.name;
+    uint64_t start = profile_now();
+
+    // the worlds are big, keep them off the stack
+    std::unique_ptr<PhysicsWorld> physics(new PhysicsWorld());
+    std::unique_ptr<LogicWorld> logic(new LogicWorld());
+    physics->periodic = scenario.periodic;
+    physics->deterministic = scenario.deterministic;
+    physics->broadphase = scenario.broadphase;
+    init_physics(physics.get());
+    if (!scenario.snapshot_file.empty())
+    {
+	if (!load_snapshot(physics.get(), logic.get(), scenario.snapshot_file.c_str()))
+	{
+	    LOG_MSG("Scenario ", scenario.name, " not run");
+	    return summary;
+	}
+    }
+    else
+	init_logic_world(logic.get(), physics.get());
+
+    glm::vec2 start_center;
+    mass_center(physics.get(), &start_center);
+    for (int step = 0; step != scenario.steps; ++step)
+    {
+	PROFILE_SCOPE("batch step");
+	update_logic(logic.get(), physics.get(), scenario.step_time);
+	update_physics(physics.get(), scenario.step_time);
+    }
+
+    summary.ok = true;
+    summary.steps = scenario.steps;
+    glm::vec2 end_center;
+    summary.total_mass = mass_center(physics.get(), &end_center);
+    summary.center_of_mass_drift = glm::length(end_center - start_center);
+    float speed_sum = 0;
+    physics->bodies.for_each([&](Body *body)
+	{
+	    ++summary.bodies;
+	    speed_sum+= glm::length(body->vel);
+	});
+    if (summary.bodies)
+	summary.mean_speed = speed_sum / summary.bodies;
+    physics->attachments.iter().do_each([&](Attachment *) {++summary.attachments;});
+    for (size_t tag = 0; tag != CELL_TYPE_TAGS; ++tag)
+    {
+	summary.cells_per_tag[tag] = logic->buckets[tag].size();
+	summary.cells+= summary.cells_per_tag[tag];
+    }
+    summary.state_hash = hash_world_state(physics.get(), logic.get());
+    summary.wall_seconds = (profile_now() - start) / 1e9;
+    return summary;
+}
+
+std::vector<WorldSummary> run_batch(std::vector<BatchScenario> const &scenarios, unsigned threads)
+{
+    if (!threads)
+	threads = std::max(std::thread::hardware_concurrency(), 1u);
+    threads = std::min<size_t>(threads, std::max<size_t>(scenarios.size(), 1));
+
+    std::vector<WorldSummary> summaries(scenarios.size());
+    // every worker only writes the summaries of the scenarios it took
+    std::atomic<size_t> next{0};
+    auto work = [&](unsigned index)
+    {
+	set_profile_thread_name("batch " + std::to_string(index));
+	for (size_t i = next++; i < scenarios.size(); i = next++)
+	    summaries[i] = run_scenario(scenarios[i]);
+    };
+    std::vector<std::thread> workers;
+    for (unsigned i = 1; i < threads; ++i)
+	workers.emplace_back(work, i);
+    work(0);
+    for (std::thread &worker : workers)
+	worker.join();
+    return summaries;
+}
+
+bool parse_batch_file(const char *filename, std::vector<BatchScenario> *scenarios)
+{
+    std::ifstream file(filename);
+    if (!file)
+    {
+	LOG_MSG("Cannot open ", filename);
+	return false;
+    }
+    std::string line;
+    for (int line_number = 1; std::getline(file, line); ++line_number)
+    {
+	line = line.substr(0, line.find('#'));
+	std::istringstream words(line);
+	BatchScenario scenario;
+	if (!(words >> scenario.name))
+	    continue;
+	bool ok = bool(words >> scenario.steps) && scenario.steps > 0;
+	std::string word;
+	while (ok && words >> word)
+	{
+	    size_t equals = word.find('=');
+	    std::string key = word.substr(0, equals);
+	    std::string value = equals == std::string::npos ? "" : word.substr(equals + 1);
+	    if (key == "snapshot" && !value.empty())
+		scenario.snapshot_file = value;
+	    else if (key == "step_time")
+		ok = (scenario.step_time = atof(value.c_str())) > 0;
+	    else if (key == "periodic")
+		ok = parse_flag(value, &scenario.periodic);
+	    else if (key == "deterministic")
+		ok = parse_flag(value, &scenario.deterministic);
+	    else if (key == "broadphase")
+		ok = parse_broadphase_kind(value.c_str(), &scenario.broadphase);
+	    else
+		ok = false;
+	}
+	if (!ok)
+	{
+	    LOG_MSG(filename, ":", line_number, ": expected NAME STEPS [snapshot=FILE] [step_time=SECONDS]"
+		    " [periodic=0|1] [deterministic=0|1] [broadphase=grid|sweep]");
+	    return false;
+	}
+	scenarios->push_back(scenario);
+    }
+    return true;
+}
+
+void print_batch_summaries(std::ostream &out, std::vector<WorldSummary> const &summaries)
+{
+    for (WorldSummary const &summary : summaries)
+    {
+	out << summary.name << ": ";
+	if (!summary.ok)
+	{
+	    out << "failed\n";
+	    continue;
+	}
+	out << summary.steps << " steps in " << summary.wall_seconds << " s; "
+	    << summary.bodies << " bodies, " << summary.attachments << " attachments, "
+	    << summary.cells << " cells (";
+	for (size_t tag = 0; tag != CELL_TYPE_TAGS; ++tag)
+	    out << (tag ? ", " : "") << summary.cells_per_tag[tag] << " " << CELL_TAG_NAMES[tag];
+	out << "); mass " << summary.total_mass << ", center of mass moved "
+	    << summary.center_of_mass_drift << ", mean speed " << summary.mean_speed
+	    << "; hash " << std::hex << std::setw(16) << std::setfill('0') << summary.state_hash
+	    << std::dec << std::setfill(' ') << "\n";
+    }
+}
+
+bool write_batch_csv(const char *filename, std::vector<WorldSummary> const &summaries)
+{
+    FILE *file = fopen(filename, "w");
+    if (!file)
+    {
+	LOG_MSG("Cannot open ", filename, " for writing");
+	return false;
+    }
+    fprintf(file, "name,ok,steps,bodies,attachments,cells");
+    for (const char *tag_name : CELL_TAG_NAMES)
+	fprintf(file, ",%s_cells", tag_name);
+    fprintf(file, ",total_mass,center_of_mass_drift,mean_speed,state_hash,wall_seconds\n");
+    for (WorldSummary const &summary : summaries)
+    {
+	fprintf(file, "%s,%d,%d,%zu,%zu,%zu", summary.name.c_str(), summary.ok, summary.steps,
+		summary.bodies, summary.attachments, summary.cells);
+	for (size_t count : summary.cells_per_tag)
+	    fprintf(file, ",%zu", count);
+	fprintf(file, ",%g,%g,%g,%016llx,%.6f\n", summary.total_mass, summary.center_of_mass_drift,
+		summary.mean_speed, (unsigned long long)summary.state_hash, summary.wall_seconds);
+    }
+    bool ok = fclose(file) == 0;
+    if (ok)
+	LOG_MSG("Wrote ", filename);
+    return ok;
+}
@@ -0,0 +1,63 @@
+#ifndef BATCH_HPP_INCLUDED
+#define BATCH_HPP_INCLUDED
+
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+#include "physics/physics.hpp"
+#include "logic/logic.hpp"
+
+/// Runs many independent worlds headless, spread over the cores.
+///
+/// Every scenario gets a PhysicsWorld and a LogicWorld of its own, which only
+/// its worker thread touches, so the worlds share no mutable state and step
+/// as they would alone (a deterministic scenario gives the same state hash on
+/// any number of threads). The workers take the next scenario when they are
+/// done with one, several short scenarios end up on the same thread.
+
+struct BatchScenario
+{
+    std::string name;
+    /// snapshot to start from, empty: the organisms of init_logic_world()
+    std::string snapshot_file;
+    int steps = 1000;
+    float step_time = 1 / 30.f;
+    bool periodic = false;
+    bool deterministic = false;
+    BroadphaseKind broadphase = BROADPHASE_GRID;
+};
+
+/// The state of a world at the end of its run
+struct WorldSummary
+{
+    std::string name;
+    /// false if the world could not be set up (the reason is logged)
+    bool ok = false;
+    int steps = 0;
+    size_t bodies = 0, attachments = 0, cells = 0;
+    size_t cells_per_tag[CELL_TYPE_TAGS] = {};
+    float total_mass = 0;
+    /// how far the center of mass moved from the first step to the last
+    float center_of_mass_drift = 0;
+    float mean_speed = 0;
+    uint64_t state_hash = 0;
+    double wall_seconds = 0;
+};
+
+/// Simulate the scenarios on the given number of threads, 0: one per core.
+/// The summaries are in the order of the scenarios.
+std::vector<WorldSummary> run_batch(std::vector<BatchScenario> const &scenarios, unsigned threads);
+/// Set up and simulate one scenario on the calling thread
+WorldSummary run_scenario(BatchScenario const &scenario);
+
+/// Read a scenario list: one scenario per line, "NAME STEPS [KEY=VALUE]...",
+/// the keys are snapshot=FILE, step_time=SECONDS, periodic=0|1,
+/// deterministic=0|1 and broadphase=grid|sweep; # starts a comment.
+/// On failure, the reason is logged and false is returned.
+bool parse_batch_file(const char *filename, std::vector<BatchScenario> *scenarios);
+void print_batch_summaries(std::ostream &out, std::vector<WorldSummary> const &summaries);
+/// One line per world, with a header line
+bool write_batch_csv(const char *filename, std::vector<WorldSummary> const &summaries);
+
+#endif
@@ -0,0 +1,238 @@
+#include "Logger.hpp"
+#include "assets.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "CImg.h"
+
+using namespace cimg_library;
+
+static_assert(sizeof(TextureCacheHeader) == 136, "cache layout changed, bump TEXTURE_CACHE_VERSION");
+
+const char *TEXTURE_FILES[TEXTURE_SOURCES] = {
+    "res/cell.png",
+    "res/attachment.png",
+    "res/background.png",
+};
+
+/// Transparent gap between the images of the atlas
+constexpr uint32_t ATLAS_PADDING = 4;
+
+struct DecodedImage
+{
+    int width, height;
+    unsigned char *pixels;
+};
+
+unsigned char *load_img(const char *filename, int *width, int *height)
+{
+    CImg<unsigned char> img(filename);
+    int w = img.width(), h = img.height();
+    *width = w;
+    *height = h;
+    if (img.spectrum() != 3 && img.spectrum() != 4)
+	LOG_FATAL("Cannot load ", filename, " 3 or 4 channels required, have ", img.spectrum());
+
+    // CImg stores the channels as planes
+    unsigned char *pixels = new unsigned char[w * h * 4];
+    for (int c = 0; c != 4; ++c)
+    {
+	unsigned char *out = pixels + c;
+	if (c == 3 && img.spectrum() == 3)
+	{
+	    for (int i = 0; i != w * h; ++i)
+		out[i * 4] = 255;
+	    continue;
+	}
+	unsigned char const *plane = img.data(0, 0, 0, c);
+	for (int i = 0; i != w * h; ++i)
+	    out[i * 4] = plane[i];
+    }
+    LOG_MSG("Loaded image ",
+	     filename, ": ",
+	     w, "x", h, img.spectrum() == 3 ? "@RGB" : "@RGBA");
+    return pixels;
+}
+
+/// Size and modification time of the source images, false if one is missing
+bool stat_sources(int64_t mtimes[TEXTURE_SOURCES], uint64_t sizes[TEXTURE_SOURCES])
+{
+    for (int i = 0; i != TEXTURE_SOURCES; ++i)
+    {
+	struct stat st;
+	if (stat(TEXTURE_FILES[i], &st) != 0)
+	    return false;
+	mtimes[i] = st.st_mtime;
+	sizes[i] = st.st_size;
+    }
+    return true;
+}
+
+/// Take the textures from the mapped cache, false if it is missing or stale
+bool load_texture_cache(TextureAssets *assets, const char *cache_filename)
+{
+    int64_t mtimes[TEXTURE_SOURCES];
+    uint64_t sizes[TEXTURE_SOURCES];
+    if (!stat_sources(mtimes, sizes))
+	return false;
+
+    int fd = open(cache_filename, O_RDONLY);
+    if (fd < 0)
+	return false;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(TextureCacheHeader))
+    {
+	close(fd);
+	return false;
+    }
+    void *data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+	return false;
+
+    TextureCacheHeader const *header = (TextureCacheHeader const *)data;
+    uint64_t atlas_size = (uint64_t)header->atlas_width * header->atlas_height * 4;
+    uint64_t background_size = (uint64_t)header->background_width * header->background_height * 4;
+    bool valid = memcmp(header->magic, TEXTURE_CACHE_MAGIC, 8) == 0
+	&& header->version == TEXTURE_CACHE_VERSION
+	&& header->header_size == sizeof(TextureCacheHeader)
+	&& memcmp(header->source_mtimes, mtimes, sizeof(mtimes)) == 0
+	&& memcmp(header->source_sizes, sizes, sizeof(sizes)) == 0
+	&& header->file_size == (uint64_t)st.st_size
+	&& header->atlas_offset >= sizeof(TextureCacheHeader)
+	&& header->atlas_offset + atlas_size <= header->file_size
+	&& header->background_offset >= sizeof(TextureCacheHeader)
+	&& header->background_offset + background_size <= header->file_size;
+    for (int i = 0; valid && i != TEXTURE_BACKGROUND; ++i)
+    {
+	AtlasRect const &rect = header->rects[i];
+	valid = rect.x + rect.width <= header->atlas_width
+	    && rect.y + rect.height <= header->atlas_height;
+    }
+    if (!valid)
+    {
+	LOG_MSG("Texture cache ", cache_filename, " is stale");
+	munmap(data, st.st_size);
+	return false;
+    }
+
+    assets->atlas_width = header->atlas_width;
+    assets->atlas_height = header->atlas_height;
+    memcpy(assets->rects, header->rects, sizeof(assets->rects));
+    assets->background_width = header->background_width;
+    assets->background_height = header->background_height;
+    assets->atlas_pixels = (unsigned char const *)data + header->atlas_offset;
+    assets->background_pixels = (unsigned char const *)data + header->background_offset;
+    assets->mapping = data;
+    assets->mapping_size = st.st_size;
+    LOG_MSG("Loaded textures from ", cache_filename);
+    return true;
+}
+
+/// Decode the images in parallel, pack the atlas and write the cache
+void build_texture_assets(TextureAssets *assets, const char *cache_filename)
+{
+    DecodedImage images[TEXTURE_SOURCES];
+    std::thread decoders[TEXTURE_SOURCES];
+    for (int i = 0; i != TEXTURE_SOURCES; ++i)
+	decoders[i] = std::thread([&images, i]()
+	{
+	    images[i].pixels = load_img(TEXTURE_FILES[i], &images[i].width, &images[i].height);
+	});
+    for (int i = 0; i != TEXTURE_SOURCES; ++i)
+	decoders[i].join();
+
+    // the atlas images are stacked
+    TextureCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TEXTURE_CACHE_MAGIC, 8);
+    header.version = TEXTURE_CACHE_VERSION;
+    header.header_size = sizeof(header);
+    bool has_sources = stat_sources(header.source_mtimes, header.source_sizes);
+    for (int i = 0; i != TEXTURE_BACKGROUND; ++i)
+    {
+	AtlasRect &rect = header.rects[i];
+	rect.x = 0;
+	rect.y = header.atlas_height == 0 ? 0 : header.atlas_height + ATLAS_PADDING;
+	rect.width = images[i].width;
+	rect.height = images[i].height;
+	header.atlas_height = rect.y + rect.height;
+	if (rect.width > header.atlas_width)
+	    header.atlas_width = rect.width;
+    }
+    header.background_width = images[TEXTURE_BACKGROUND].width;
+    header.background_height = images[TEXTURE_BACKGROUND].height;
+    header.atlas_offset = sizeof(header);
+    header.background_offset = header.atlas_offset
+	+ (uint64_t)header.atlas_width * header.atlas_height * 4;
+    header.file_size = header.background_offset
+	+ (uint64_t)header.background_width * header.background_height * 4;
+
+    // the file image is kept as the storage of the pixels
+    std::vector<unsigned char> &storage = assets->storage;
+    storage.assign(header.file_size, 0);
+    memcpy(storage.data(), &header, sizeof(header));
+    unsigned char *atlas = storage.data() + header.atlas_offset;
+    for (int i = 0; i != TEXTURE_BACKGROUND; ++i)
+    {
+	AtlasRect const &rect = header.rects[i];
+	for (uint32_t y = 0; y != rect.height; ++y)
+	    memcpy(atlas + ((rect.y + y) * header.atlas_width + rect.x) * 4,
+		   images[i].pixels + y * rect.width * 4, rect.width * 4);
+    }
+    memcpy(storage.data() + header.background_offset, images[TEXTURE_BACKGROUND].pixels,
+	   (size_t)header.background_width * header.background_height * 4);
+    for (int i = 0; i != TEXTURE_SOURCES; ++i)
+	delete[] images[i].pixels;
+
+    assets->atlas_width = header.atlas_width;
+    assets->atlas_height = header.atlas_height;
+    memcpy(assets->rects, header.rects, sizeof(assets->rects));
+    assets->background_width = header.background_width;
+    assets->background_height = header.background_height;
+    assets->atlas_pixels = storage.data() + header.atlas_offset;
+    assets->background_pixels = storage.data() + header.background_offset;
+
+    // write aside and rename, so that a broken write never leaves a valid looking cache.
+    // The name of the temporary file is unique, so that concurrent starts do not
+    // write into each other's file.
+    if (!has_sources)
+	return;
+    std::string tmp_filename = std::string(cache_filename) + ".XXXXXX";
+    int fd = mkstemp(&tmp_filename[0]);
+    FILE *file = fd >= 0 ? fdopen(fd, "wb") : nullptr;
+    if (fd >= 0 && !file)
+	close(fd);
+    bool ok = file && fwrite(storage.data(), 1, storage.size(), file) == storage.size();
+    ok = file && fclose(file) == 0 && ok;
+    if (ok && rename(tmp_filename.c_str(), cache_filename) == 0)
+	LOG_MSG("Wrote texture cache ", cache_filename);
+    else
+    {
+	if (fd >= 0)
+	    remove(tmp_filename.c_str());
+	LOG_MSG("Cannot write texture cache ", cache_filename);
+    }
+}
+
+void load_texture_assets(TextureAssets *assets, const char *cache_filename)
+{
+    if (!load_texture_cache(assets, cache_filename))
+	build_texture_assets(assets, cache_filename);
+}
+
+void free_texture_assets(TextureAssets *assets)
+{
+    if (assets->mapping)
+	munmap(assets->mapping, assets->mapping_size);
+    assets->mapping = nullptr;
+    assets->mapping_size = 0;
+    assets->storage = std::vector<unsigned char>();
+    assets->atlas_pixels = assets->background_pixels = nullptr;
+}
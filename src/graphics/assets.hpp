@@ -0,0 +1,71 @@
+#ifndef ASSETS_HPP_INCLUDED
+#define ASSETS_HPP_INCLUDED
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+/// The textures, decoded to RGBA.
+/// The cell and attachment images are packed into one atlas (stacked, with a
+/// transparent gap against filtering bleed), so both passes sample the same texture.
+/// The background repeats and thus stays a texture of its own.
+///
+/// Decoding the PNGs is slow, so the result is cached in a raw file:
+/// a TextureCacheHeader, followed by the atlas and the background pixels.
+/// The cache is valid as long as the size and modification time of every
+/// source image match the ones in the header; otherwise the images are
+/// decoded again (in parallel) and the cache is rewritten.
+
+#define TEXTURE_CACHE_MAGIC "CELLTEXC"
+constexpr uint32_t TEXTURE_CACHE_VERSION = 1;
+
+enum TextureSource
+{
+    TEXTURE_CELL,
+    TEXTURE_ATTACHMENT,
+    TEXTURE_BACKGROUND,
+    TEXTURE_SOURCES
+};
+
+/// Placement of an image in the atlas, in pixels
+struct AtlasRect
+{
+    uint32_t x, y, width, height;
+};
+
+struct TextureCacheHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    /// stat of the source images
+    int64_t source_mtimes[TEXTURE_SOURCES];
+    uint64_t source_sizes[TEXTURE_SOURCES];
+    uint32_t atlas_width, atlas_height;
+    AtlasRect rects[TEXTURE_BACKGROUND];
+    uint32_t background_width, background_height;
+    uint64_t atlas_offset, background_offset;
+    uint64_t file_size;
+};
+
+struct TextureAssets
+{
+    uint32_t atlas_width, atlas_height;
+    /// indexed by TEXTURE_CELL and TEXTURE_ATTACHMENT
+    AtlasRect rects[TEXTURE_BACKGROUND];
+    uint32_t background_width, background_height;
+    /// point into the mapped cache file (or into storage, if it could not be mapped)
+    unsigned char const *atlas_pixels, *background_pixels;
+
+    void *mapping = nullptr;
+    size_t mapping_size = 0;
+    std::vector<unsigned char> storage;
+};
+
+/// Load the textures from the cache, or decode them and write the cache.
+/// Exits on undecodable images, like the rest of the asset loading.
+void load_texture_assets(TextureAssets *assets, const char *cache_filename);
+/// Release the pixels, after they were uploaded
+void free_texture_assets(TextureAssets *assets);
+
+#endif
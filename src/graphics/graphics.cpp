@@ -1,14 +1,17 @@
 #include "Logger.hpp"
 #include "GLL/GLL.hpp"
 #include "graphics.hpp"
+#include "assets.hpp"
+#include <algorithm>
 #include <cmath>
+#include <cstddef>
+#include <cstring>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
-#include "CImg.h"
 #include "Logger.hpp"
 #include "logic/logic.hpp"
-
-using namespace cimg_library;
+#include "physics/query.hpp"
+#include "profiler/profiler.hpp"
 
 /// vertex layout: floats: x, y, z, u, v
 #define VERTEX_STRIDE 5
@@ -47,46 +50,14 @@ void circle(int n, float radius, float edge_z, float center_z, float tex_left, f
     {
 	float angle = 2 * M_PI / n * i;
 	float x = cos(angle), y = sin(angle);
-	set_xyz(get_n(vertices, i), x * radius, y * radius, edge_z);
+	set_xyz(get_n(vertices, i + 1), x * radius, y * radius, edge_z);
 	float u = tex_left + (x + 1) / 2 * tex_width;
 	float v = tex_top + (y + 1) / 2 * tex_height;
-	set_uv(get_n(vertices, i), u, v);
+	set_uv(get_n(vertices, i + 1), u, v);
     }
 }
 
-unsigned char *load_img(const char *filename, int *width, int *height)
-{
-    CImg<unsigned char> img(filename);
-    *width = img.width();
-    *height = img.height();
-    unsigned char *pixels = new unsigned char[img.width() * img.height() * 4];
-    if (img.spectrum() == 4)
-	for (int y = 0; y < img.height(); ++y)
-	for (int x = 0; x < img.width(); ++x)
-	{
-	    pixels[y * img.width() * 4 + x * 4 + 0] = img(x, y, 0);
-	    pixels[y * img.width() * 4 + x * 4 + 1] = img(x, y, 1);
-	    pixels[y * img.width() * 4 + x * 4 + 2] = img(x, y, 2);
-	    pixels[y * img.width() * 4 + x * 4 + 3] = img(x, y, 3);
-	}
-    else if (img.spectrum() == 3)
-	for (int y = 0; y < img.height(); ++y)
-	for (int x = 0; x < img.width(); ++x)
-	{
-	    pixels[y * img.width() * 4 + x * 4 + 0] = img(x, y, 0);
-	    pixels[y * img.width() * 4 + x * 4 + 1] = img(x, y, 1);
-	    pixels[y * img.width() * 4 + x * 4 + 2] = img(x, y, 2);
-	    pixels[y * img.width() * 4 + x * 4 + 3] = 255;
-	}
-    else
-	LOG_FATAL("Cannot load ", filename, " 3 or 4 channels required, have ", img.spectrum());
-    LOG_MSG("Loaded image ",
-	     filename, ": ",
-	     img.width(), "x", img.height(), img.spectrum() == 3 ? "@RGB" : "@RGBA");
-    return pixels;
-}
-
-void upload_texture(GLuint *texture, unsigned char *pixels, int width, int height, GLuint unit)
+void upload_texture(GLuint *texture, unsigned char const *pixels, int width, int height, GLuint unit)
 {
     // push texture to gpu
     glGenTextures(1, texture);
@@ -98,6 +69,127 @@ void upload_texture(GLuint *texture, unsigned char *pixels, int width, int heigh
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
 }
 
+/// Point the instance attributes of the bound cell vao to the data at offset in the cell stream
+void set_cell_instance_attributes(Graphics *graphics, GLintptr offset)
+{
+    GLenum floatType = gll::OpenGLType<float>::type;
+    graphics->cell_stream.bind();
+    glVertexAttribPointer(graphics->program_vars.instPosAngleRadius, 4, floatType, GL_FALSE,
+			  sizeof(CellInstance), (void *)(offset + offsetof(CellInstance, x)));
+    glVertexAttribPointer(graphics->program_vars.instOverlayColor, 4, floatType, GL_FALSE,
+			  sizeof(CellInstance), (void *)(offset + offsetof(CellInstance, overlay_color)));
+    glVertexAttribPointer(graphics->program_vars.instTexOffY, 1, floatType, GL_FALSE,
+			  sizeof(CellInstance), (void *)(offset + offsetof(CellInstance, tex_off_y)));
+}
+
+/// Build a program of the cell shaders, with the defines inserted into the fragment shader
+void init_cell_program(gll::Program *program, ProgramVars *vars, std::string const &defines)
+{
+    program->create();
+    program->setBinaryCache("res/program-");
+    program->addShader(GL_VERTEX_SHADER, "res/shader.vert", true);
+    program->addShader(GL_FRAGMENT_SHADER, "res/shader.frag", true, defines);
+    vars->vertXYZ = program->getAttribute("vertXYZ");
+    vars->vertUV = program->getAttribute("vertUV");
+    vars->instPosAngleRadius = program->getAttribute("instPosAngleRadius");
+    vars->instOverlayColor = program->getAttribute("instOverlayColor");
+    vars->instTexOffY = program->getAttribute("instTexOffY");
+    program->link();
+    vars->mvp = program->getUniformLocation("mvp");
+    vars->tex = program->getUniformLocation("tex");
+    vars->texRect = program->getUniformLocation("texRect");
+    vars->pixelsPerUnit = program->getUniformLocation("pixelsPerUnit");
+}
+
+/// Set the uniforms of the cell pass on the bound cell program
+void set_cell_uniforms(Graphics *graphics, ProgramVars const &vars, glm::mat4 const &view,
+		       float pixels_per_unit)
+{
+    glUniformMatrix4fv(vars.mvp, 1, false, &view[0][0]);
+    glUniform1i(vars.tex, Graphics::atlas_texture_unit);
+    glUniform4fv(vars.texRect, 1, &graphics->cell_tex_rect[0]);
+    glUniform1f(vars.pixelsPerUnit, pixels_per_unit);
+}
+
+/// Point the body indices of the bound attachment vao to the data at offset in the attachment stream
+void set_attachment_instance_attributes(Graphics *graphics, GLintptr offset)
+{
+    graphics->attachment_stream.bind();
+    glVertexAttribIPointer(graphics->attachment_program_vars.instBodies, 2, GL_INT,
+			   2 * sizeof(GLint), (void *)offset);
+}
+
+bool parse_gl_error_check(const char *name, GLErrorCheck *check)
+{
+    const char *names[] = {"off", "debug", "frame", "call"};
+    for (int i = 0; i != 4; ++i)
+	if (strcmp(name, names[i]) == 0)
+	{
+	    *check = (GLErrorCheck)i;
+	    return true;
+	}
+    return false;
+}
+
+/// Print every pending GL error
+void check_gl_errors()
+{
+    for (GLenum error = glGetError(); error != GL_NO_ERROR; error = glGetError())
+	std::cout << "error: " << std::hex << error << std::dec << std::endl;
+}
+
+/// Called by the driver, possibly on a thread of its own
+void GL_APIENTRY debug_output_callback(GLenum source, GLenum type, GLuint id, GLenum severity,
+				       GLsizei length, const GLchar *message, const void *)
+{
+    std::cout << "GL debug output (type " << std::hex << type << ", severity " << severity
+	      << std::dec << "): " << std::string(message, length) << std::endl;
+}
+
+/// Install the error checking of graphics->error_check
+void init_error_check(Graphics *graphics)
+{
+    if (graphics->error_check == ERROR_CHECK_DEBUG_OUTPUT)
+    {
+	if (gll::hasVersion(4, 3) || gll::hasExtension("GL_KHR_debug"))
+	{
+	    glEnable(GL_DEBUG_OUTPUT);
+	    glDebugMessageCallback(debug_output_callback, nullptr);
+	    glDebugMessageControl(GL_DONT_CARE, GL_DONT_CARE, GL_DEBUG_SEVERITY_NOTIFICATION,
+				  0, nullptr, GL_FALSE);
+	}
+	else if (gll::hasExtension("GL_ARB_debug_output"))
+	{
+	    // only reports in debug contexts
+	    glDebugMessageCallbackARB(debug_output_callback, nullptr);
+	}
+	else
+	{
+	    LOG_MSG("No GL debug output, checking for GL errors once per frame");
+	    graphics->error_check = ERROR_CHECK_PER_FRAME;
+	}
+    }
+    else if (graphics->error_check == ERROR_CHECK_PER_CALL)
+    {
+	using namespace glbinding;
+	setCallbackMaskExcept(CallbackMask::After, { "glGetError" });
+	setAfterCallback([](const FunctionCall &)
+	{
+	    const auto error = glGetError();
+	    if (error != GL_NO_ERROR)
+		std::cout << "error: " << std::hex << error << std::endl;
+	});
+    }
+}
+
+/// u, v, width, height of the image in the atlas
+glm::vec4 atlas_rect(TextureAssets const &assets, TextureSource source)
+{
+    AtlasRect const &rect = assets.rects[source];
+    return glm::vec4(rect.x / (float)assets.atlas_width, rect.y / (float)assets.atlas_height,
+		     rect.width / (float)assets.atlas_width, rect.height / (float)assets.atlas_height);
+}
+
 void init_graphics(Graphics *graphics, PhysicsWorld *physics)
 {
     gll::init();
@@ -105,50 +197,66 @@ void init_graphics(Graphics *graphics, PhysicsWorld *physics)
     gll::setDepthTest(true);
     glEnable (GL_BLEND);
     glBlendFunc (GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    glEnable(GL_PROGRAM_POINT_SIZE);
 
-    using namespace glbinding;
-    setCallbackMaskExcept(CallbackMask::After, { "glGetError" });
-    setAfterCallback([](const FunctionCall &)
-    {
-	const auto error = glGetError();
-	if (error != GL_NO_ERROR)
-	    std::cout << "error: " << std::hex << error << std::endl;
-    });
+    init_error_check(graphics);
     
-    // shader
-    gll::Program program;
-    program.create();
-    program.addShader(GL_VERTEX_SHADER, "res/shader.vert", true);
-    program.addShader(GL_FRAGMENT_SHADER, "res/shader.frag", true);
-    graphics->program_vars.vertXYZ = program.getAttribute("vertXYZ");
-    graphics->program_vars.vertUV = program.getAttribute("vertUV");
-    program.link();
-    graphics->program_vars.mvp = program.getUniformLocation("mvp");
-    graphics->program_vars.tex = program.getUniformLocation("tex");
-    graphics->program_vars.tex_off_y = program.getUniformLocation("tex_off_y");
-    graphics->program_vars.overlay_color = program.getUniformLocation("overlay_color");
-    program.bind();
+    // shader, the attributes of both cell programs are bound to the same locations
+    gll::Program &program = graphics->program;
+    init_cell_program(&program, &graphics->program_vars, "");
+    init_cell_program(&graphics->circle_program, &graphics->circle_program_vars,
+		      "#define CIRCLE_MASK\n");
+
+    gll::Program &attachment_program = graphics->attachment_program;
+    AttachmentProgramVars &attachment_vars = graphics->attachment_program_vars;
+    attachment_program.create();
+    attachment_program.setBinaryCache("res/program-");
+    attachment_program.addShader(GL_VERTEX_SHADER, "res/attachment.vert", true);
+    attachment_program.addShader(GL_FRAGMENT_SHADER, "res/shader.frag", true);
+    attachment_vars.vertXYZ = attachment_program.getAttribute("vertXYZ");
+    attachment_vars.vertUV = attachment_program.getAttribute("vertUV");
+    attachment_vars.instBodies = attachment_program.getAttribute("instBodies");
+    attachment_program.link();
+    attachment_vars.mvp = attachment_program.getUniformLocation("mvp");
+    attachment_vars.tex = attachment_program.getUniformLocation("tex");
+    attachment_vars.texRect = attachment_program.getUniformLocation("texRect");
+    attachment_vars.bodies = attachment_program.getUniformLocation("bodies");
+    attachment_program.bind();
+    glUniform1i(attachment_vars.tex, Graphics::atlas_texture_unit);
+    glUniform1i(attachment_vars.bodies, Graphics::body_buffer_texture_unit);
 
-    // cell texture
-    int width, height;
-    unsigned char *pixels = load_img("res/cell.png", &width, &height);
-    upload_texture(&graphics->cell_tex, pixels, width, height, Graphics::cell_texture_unit);
-    delete[] pixels;
-    graphics->cell_tex_rows = height / width;
-
-    // attachment texture
-    pixels = load_img("res/attachment.png", &width, &height);
-    upload_texture(&graphics->attachment_tex, pixels, width, height,
-		   Graphics::attachment_texture_unit);
-    delete[] pixels;
-
-    // background texture
-    pixels = load_img("res/background.png", &width, &height);
-    upload_texture(&graphics->background_tex, pixels, width, height,
+    // streamed per-frame data
+    graphics->cell_stream.create(GL_ARRAY_BUFFER, MAX_CELLS * sizeof(CellInstance));
+    graphics->attachment_stream.create(GL_ARRAY_BUFFER, MAX_ATTACHMENTS * 2 * sizeof(GLint));
+    graphics->body_stream.create(GL_TEXTURE_BUFFER, MAX_BODIES * sizeof(glm::vec4));
+    LOG_MSG("Streaming render data through ",
+	    graphics->cell_stream.isPersistent() ? "persistently mapped" : "orphaned", " buffers");
+
+    // body buffer texture
+    glGenTextures(1, &graphics->body_buffer_tex);
+    glActiveTexture(GL_TEXTURE0 + Graphics::body_buffer_texture_unit);
+    glBindTexture(GL_TEXTURE_BUFFER, graphics->body_buffer_tex);
+    glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, graphics->body_stream.id());
+
+    // textures: the cell and attachment images share the atlas
+    TextureAssets assets;
+    load_texture_assets(&assets, "res/textures.cache");
+    upload_texture(&graphics->atlas_tex, assets.atlas_pixels,
+		   assets.atlas_width, assets.atlas_height, Graphics::atlas_texture_unit);
+    AtlasRect const &cell_rect = assets.rects[TEXTURE_CELL];
+    graphics->cell_tex_rows = cell_rect.height / cell_rect.width;
+    graphics->cell_tex_rect = atlas_rect(assets, TEXTURE_CELL);
+    glm::vec4 attachment_tex_rect = atlas_rect(assets, TEXTURE_ATTACHMENT);
+    glUniform4fv(attachment_vars.texRect, 1, &attachment_tex_rect[0]);
+
+    upload_texture(&graphics->background_tex, assets.background_pixels,
+		   assets.background_width, assets.background_height,
 		   Graphics::background_texture_unit);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
     glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-    delete[] pixels;
+    free_texture_assets(&assets);
+
+    program.bind();
 
     // cell vbo & vao
     {
@@ -157,10 +265,23 @@ void init_graphics(Graphics *graphics, PhysicsWorld *physics)
 	glGenVertexArrays(1, &vao);
 	
 	constexpr int circle_resolution = 20;
-	float vertices[(circle_resolution+2) * VERTEX_STRIDE];
-	circle(circle_resolution, 1, 1, 0, 0, 0, 1, 1/(float)graphics->cell_tex_rows, vertices);
+	static_assert(circle_resolution + 2 == Graphics::cell_quad_first, "quad follows the fan");
+	constexpr int vertex_count = Graphics::cell_point_first + 1;
+	float vertices[vertex_count * VERTEX_STRIDE];
+	float tex_height = 1/(float)graphics->cell_tex_rows;
+	circle(circle_resolution, 1, 1, 0, 0, 0, 1, tex_height, vertices);
+	// quad (triangle strip) and point, textured like the circle
+	float quad[4][2] = {{-1, -1}, {+1, -1}, {-1, +1}, {+1, +1}};
+	for (int i = 0; i != 4; ++i)
+	{
+	    float *vertex = get_n(vertices, Graphics::cell_quad_first + i);
+	    set_xyz(vertex, quad[i][0], quad[i][1], 1);
+	    set_uv(vertex, (quad[i][0] + 1) / 2, (quad[i][1] + 1) / 2 * tex_height);
+	}
+	set_xyz(get_n(vertices, Graphics::cell_point_first), 0, 0, 0);
+	set_uv(get_n(vertices, Graphics::cell_point_first), 0.5, 0.5 * tex_height);
 	glBindBuffer(GL_ARRAY_BUFFER, vbo);
-	glBufferData(GL_ARRAY_BUFFER, (circle_resolution + 2) * VERTEX_STRIDE * sizeof(float), vertices, GL_STATIC_DRAW);
+	glBufferData(GL_ARRAY_BUFFER, sizeof(vertices), vertices, GL_STATIC_DRAW);
 	
 	glBindVertexArray(vao);
 	GLenum floatType = gll::OpenGLType<float>::type;
@@ -171,6 +292,15 @@ void init_graphics(Graphics *graphics, PhysicsWorld *physics)
 			      stride, (void *)(0 * sizeof(float)));
 	glVertexAttribPointer(graphics->program_vars.vertUV, 2, floatType, GL_FALSE,
 			      stride, (void *)(3 * sizeof(float)));
+
+	// per-instance attributes
+	glEnableVertexAttribArray(graphics->program_vars.instPosAngleRadius);
+	glEnableVertexAttribArray(graphics->program_vars.instOverlayColor);
+	glEnableVertexAttribArray(graphics->program_vars.instTexOffY);
+	glVertexAttribDivisor(graphics->program_vars.instPosAngleRadius, 1);
+	glVertexAttribDivisor(graphics->program_vars.instOverlayColor, 1);
+	glVertexAttribDivisor(graphics->program_vars.instTexOffY, 1);
+	set_cell_instance_attributes(graphics, 0);
 	
 	graphics->cell_model.vbo = vbo;
 	graphics->cell_model.vao = vao;	
@@ -182,6 +312,7 @@ void init_graphics(Graphics *graphics, PhysicsWorld *physics)
 	glGenBuffers(1, &vbo);
 	glGenVertexArrays(1, &vao);
 
+	// stretched between the bodies in attachment.vert
      	float vertices[6 * VERTEX_STRIDE] = {
 	    -1, 0, 1,  0, 0,
 	    +1, 0, 1,  0, 1,
@@ -196,13 +327,18 @@ void init_graphics(Graphics *graphics, PhysicsWorld *physics)
 	
 	glBindVertexArray(vao);
 	GLenum floatType = gll::OpenGLType<float>::type;
-	glEnableVertexAttribArray(graphics->program_vars.vertXYZ);
-	glEnableVertexAttribArray(graphics->program_vars.vertUV);
+	glEnableVertexAttribArray(attachment_vars.vertXYZ);
+	glEnableVertexAttribArray(attachment_vars.vertUV);
 	int stride = VERTEX_STRIDE * sizeof(float);
-	glVertexAttribPointer(graphics->program_vars.vertXYZ, 3, floatType, GL_FALSE,
+	glVertexAttribPointer(attachment_vars.vertXYZ, 3, floatType, GL_FALSE,
 			      stride, (void *)(0 * sizeof(float)));
-	glVertexAttribPointer(graphics->program_vars.vertUV, 2, floatType, GL_FALSE,
+	glVertexAttribPointer(attachment_vars.vertUV, 2, floatType, GL_FALSE,
 			      stride, (void *)(3 * sizeof(float)));
+
+	// per-instance body indices
+	glEnableVertexAttribArray(attachment_vars.instBodies);
+	glVertexAttribDivisor(attachment_vars.instBodies, 1);
+	set_attachment_instance_attributes(graphics, 0);
 	
 	graphics->attachment_model.vbo = vbo;
 	graphics->attachment_model.vao = vao;		
@@ -214,8 +350,8 @@ void init_graphics(Graphics *graphics, PhysicsWorld *physics)
 	glGenBuffers(1, &vbo);
 	glGenVertexArrays(1, &vao);
 	
-	float bg_w = physics->body_rooms.room_width * ROOMS_X;
-	float bg_h = physics->body_rooms.room_height * ROOMS_Y;
+	float bg_w = physics->width;
+	float bg_h = physics->height;
 	float tile_w = 20, tile_h = tile_w;
 
 	// one room, one texture
@@ -244,75 +380,330 @@ void init_graphics(Graphics *graphics, PhysicsWorld *physics)
 	graphics->background_model.vbo = vbo;
 	graphics->background_model.vao = vao;		
     }
+
+    // heatmap vbo & vao, the vertices follow the size of the world in render()
+    {
+	GLuint vbo, vao;
+	glGenBuffers(1, &vbo);
+	glGenVertexArrays(1, &vao);
+	glBindBuffer(GL_ARRAY_BUFFER, vbo);
+	glBufferData(GL_ARRAY_BUFFER, 6 * VERTEX_STRIDE * sizeof(float), nullptr, GL_DYNAMIC_DRAW);
+
+	glBindVertexArray(vao);
+	GLenum floatType = gll::OpenGLType<float>::type;
+	glEnableVertexAttribArray(graphics->program_vars.vertXYZ);
+	glEnableVertexAttribArray(graphics->program_vars.vertUV);
+	int stride = VERTEX_STRIDE * sizeof(float);
+	glVertexAttribPointer(graphics->program_vars.vertXYZ, 3, floatType, GL_FALSE,
+			      stride, (void *)(0 * sizeof(float)));
+	glVertexAttribPointer(graphics->program_vars.vertUV, 2, floatType, GL_FALSE,
+			      stride, (void *)(3 * sizeof(float)));
+
+	graphics->heatmap_model.vbo = vbo;
+	graphics->heatmap_model.vao = vao;
+
+	glGenTextures(1, &graphics->heatmap_tex);
+	glActiveTexture(GL_TEXTURE0 + Graphics::heatmap_texture_unit);
+	glBindTexture(GL_TEXTURE_2D, graphics->heatmap_tex);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+	glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+    }
+}
+
+/// The part of the world that is visible with the given view, including the margin
+void visible_area(glm::mat4 const &view, glm::vec2 *min, glm::vec2 *max)
+{
+    // the corners of the screen in world coordinates
+    glm::mat4 inverse_view = glm::inverse(view);
+    glm::vec2 world_min(INFINITY, INFINITY), world_max(-INFINITY, -INFINITY);
+    for (int corner = 0; corner != 4; ++corner)
+    {
+	glm::vec4 ndc(corner & 1 ? 1 : -1, corner & 2 ? 1 : -1, 0, 1);
+	glm::vec4 world = inverse_view * ndc;
+	glm::vec2 point = glm::vec2(world.x, world.y) / world.w;
+	world_min = glm::min(world_min, point);
+	world_max = glm::max(world_max, point);
+    }
+
+    *min = world_min - glm::vec2(CULL_MARGIN, CULL_MARGIN);
+    *max = world_max + glm::vec2(CULL_MARGIN, CULL_MARGIN);
 }
 
-void render(Graphics *graphics, PhysicsWorld *physics, LogicWorld *logic, glm::mat4 const &view)
+void set_viewport(Graphics *graphics, int width, int height)
 {
+    glViewport(0, 0, width, height);
+    graphics->viewport_width = width;
+    graphics->viewport_height = height;
+}
+
+/// The detail a cell with the given radius on screen gets
+CellLOD cell_lod(float pixel_radius)
+{
+    if (pixel_radius < Graphics::lod_point_radius)
+	return CELL_LOD_POINT;
+    if (pixel_radius < Graphics::lod_quad_radius)
+	return CELL_LOD_QUAD;
+    return CELL_LOD_FAN;
+}
+
+void capture_render_snapshot(RenderSnapshot *snapshot, PhysicsWorld *physics,
+			     LogicWorld *logic, glm::mat4 const &view)
+{
+    PROFILE_SCOPE("render snapshot");
+    snapshot->view = view;
+    std::vector<glm::vec4> &bodies = snapshot->bodies;
+    std::vector<GLint> &attachments = snapshot->attachments;
+    std::vector<RenderCell> &cells = snapshot->cells;
+    bodies.clear();
+    attachments.clear();
+    cells.clear();
+
+    glm::vec2 area_min, area_max;
+    visible_area(view, &area_min, &area_max);
+
+    // bodies and cells
+    query_area(physics, area_min, area_max, [&](Body *body)
+	{
+	    body->render_index = bodies.size();
+	    bodies.push_back(glm::vec4(body->pos.x, body->pos.y, body->radius(), body->angle));
+	    if (!body->user_data)
+		return;
+	    Cell const *cell = (Cell const *)body->user_data;
+	    RenderCell render_cell;
+	    render_cell.body = body->render_index;
+	    render_cell.type = (int)cell->type()._tag;
+	    render_cell.charge = cell->charge;
+	    render_cell.fixed = body->fixed;
+	    cells.push_back(render_cell);
+	});
+
+    // attachments, through the cells, as the physics does not know the attachments of a body.
+    // Both cells reference an attachment, it is taken from the one at the lower address
+    // if both are gathered. An attachment leaving the area is taken from the cell inside,
+    // the body outside is added to the bodies (after the gathered ones), so that
+    // long attachments crossing the view do not pop in and out at its edges.
+    int gathered_bodies = bodies.size();
+    std::vector<Body *> outside_bodies;
+    query_area(physics, area_min, area_max, [&](Body *body)
+	{
+	    if (!body->user_data)
+		return;
+	    Cell const *cell = (Cell const *)body->user_data;
+	    for (Optional<LogicAttachment> const &logic_attachment : cell->attachments)
+	    {
+		if (logic_attachment.empty)
+		    continue;
+		Cell const *other_cell = logic_attachment.value().other_cell;
+		Attachment const &attachment = logic_attachment.value().physics->value();
+		Body *other_body = attachment.bodies[attachment.bodies[0] == body ? 1 : 0];
+		bool other_gathered = other_body->render_index >= 0
+		    && other_body->render_index < gathered_bodies;
+		if (other_gathered && other_cell < cell)
+		    continue;
+		// in periodic worlds, an attachment across the bounds would be drawn across the world
+		glm::vec2 sub = attachment.bodies[1]->pos - attachment.bodies[0]->pos;
+		if (physics->periodic
+		    && (fabsf(sub.x) > physics->width / 2 || fabsf(sub.y) > physics->height / 2))
+		    continue;
+		if (other_body->render_index < 0)
+		{
+		    other_body->render_index = bodies.size();
+		    bodies.push_back(glm::vec4(other_body->pos.x, other_body->pos.y,
+					       other_body->radius(), other_body->angle));
+		    outside_bodies.push_back(other_body);
+		}
+		attachments.push_back(attachment.bodies[0]->render_index);
+		attachments.push_back(attachment.bodies[1]->render_index);
+	    }
+	});
+
+    // reset the scratch indices
+    query_area(physics, area_min, area_max, [](Body *body) {body->render_index = -1;});
+    for (Body *body : outside_bodies)
+	body->render_index = -1;
+
+    // statistics
+    CullStats &stats = snapshot->cull_stats;
+    size_t total_bodies = 0, total_cells = 0;
+    physics->bodies.iter().do_each([&](Body *) {total_bodies++;});
+    for (size_t tag = 0; tag != CELL_TYPE_TAGS; ++tag)
+	total_cells+= logic->buckets[tag].size();
+    stats.drawn_bodies = gathered_bodies;
+    stats.culled_bodies = total_bodies - gathered_bodies;
+    stats.drawn_cells = cells.size();
+    stats.culled_cells = total_cells - cells.size();
+    stats.drawn_attachments = attachments.size() / 2;
+
+    // heatmap of the whole world, in the rooms of the finest level,
+    // every body is counted in the room of its center, whatever the broadphase
+    snapshot->room_occupancy.clear();
+    if (snapshot->room_heatmap)
+    {
+	RoomLevel const &finest = physics->body_rooms.levels[0];
+	snapshot->rooms_x = finest.rooms_x;
+	snapshot->rooms_y = finest.rooms_y;
+	snapshot->room_width = finest.room_width;
+	snapshot->room_height = finest.room_height;
+	snapshot->room_occupancy.assign(finest.rooms_x * finest.rooms_y, 0);
+	physics->bodies.iter().do_each([&](Body *body)
+	    {
+		int x, y;
+		finest.room_of(body->pos, &x, &y);
+		snapshot->room_occupancy[x + y * finest.rooms_x]++;
+	    });
+    }
+}
+
+/// Draw the bodies per room over the world: empty rooms are clear,
+/// the others go from blue to red with the share of the fullest room
+void render_room_heatmap(Graphics *graphics, RenderSnapshot const &snapshot)
+{
+    uint16_t max_occupancy = *std::max_element(snapshot.room_occupancy.begin(),
+					       snapshot.room_occupancy.end());
+    std::vector<unsigned char> pixels(snapshot.room_occupancy.size() * 4);
+    for (size_t i = 0; i != snapshot.room_occupancy.size(); ++i)
+    {
+	uint16_t occupancy = snapshot.room_occupancy[i];
+	if (!occupancy)
+	    continue;
+	float heat = occupancy / (float)max_occupancy;
+	pixels[i * 4 + 0] = 255 * heat;
+	pixels[i * 4 + 1] = 64 * (1 - heat);
+	pixels[i * 4 + 2] = 255 * (1 - heat);
+	pixels[i * 4 + 3] = 96 + 96 * heat;
+    }
+    glActiveTexture(GL_TEXTURE0 + Graphics::heatmap_texture_unit);
+    glBindTexture(GL_TEXTURE_2D, graphics->heatmap_tex);
+    glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, snapshot.rooms_x, snapshot.rooms_y, 0,
+		 GL_RGBA, GL_UNSIGNED_BYTE, pixels.data());
+
+    float w = snapshot.room_width * snapshot.rooms_x, h = snapshot.room_height * snapshot.rooms_y;
+    float vertices[6 * VERTEX_STRIDE] = {
+	0, 0, 0,  0, 0,
+	w, 0, 0,  1, 0,
+	w, h, 0,  1, 1,
+
+	0, 0, 0,  0, 0,
+	w, h, 0,  1, 1,
+	0, h, 0,  0, 1,
+    };
+    glBindBuffer(GL_ARRAY_BUFFER, graphics->heatmap_model.vbo);
+    glBufferSubData(GL_ARRAY_BUFFER, 0, sizeof(vertices), vertices);
+
+    // on top of everything
+    gll::setDepthTest(false);
+    glUniform1i(graphics->program_vars.tex, Graphics::heatmap_texture_unit);
+    glUniform4f(graphics->program_vars.texRect, 0, 0, 1, 1);
+    glBindVertexArray(graphics->heatmap_model.vao);
+    glDrawArrays(GL_TRIANGLES, 0, 6);
+    gll::setDepthTest(true);
+}
+
+void render(Graphics *graphics, RenderSnapshot const &snapshot)
+{
+    PROFILE_SCOPE("render");
+    glm::mat4 const &view = snapshot.view;
+
     glClearColor(.1, .1, .1, 1);
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
 
-    glUniform4f(graphics->program_vars.overlay_color, 0, 0, 0, 0);
-    glUniform1f(graphics->program_vars.tex_off_y, 0);
+    // constant instance attributes of the non-instanced draws: identity transform
+    glVertexAttrib4f(graphics->program_vars.instPosAngleRadius, 0, 0, 0, 1);
+    glVertexAttrib4f(graphics->program_vars.instOverlayColor, 0, 0, 0, 0);
+    glVertexAttrib1f(graphics->program_vars.instTexOffY, 0);
 
     // background
     glUniformMatrix4fv(graphics->program_vars.mvp, 1, false, &view[0][0]);
     glUniform1i(graphics->program_vars.tex, Graphics::background_texture_unit);
+    glUniform4f(graphics->program_vars.texRect, 0, 0, 1, 1);
     glBindVertexArray(graphics->background_model.vao);
     glDrawArrays(GL_TRIANGLES, 0, 6);
 
-    // attachments
-    glUniform1i(graphics->program_vars.tex, Graphics::attachment_texture_unit);
-    
-    physics->attachments.iter().do_each([&](Attachment *attachment)
+    // bodies, read by the attachment pass
+    memcpy(graphics->body_stream.map(), snapshot.bodies.data(),
+	   snapshot.bodies.size() * sizeof(glm::vec4));
+    GLintptr body_offset = graphics->body_stream.unmap();
+    // only persistent if glTexBufferRange is there (-> StreamBuffer::create)
+    if (graphics->body_stream.isPersistent())
     {
-	Body *body0 = attachment->bodies[0];
-	Body *body1 = attachment->bodies[1];
+	glActiveTexture(GL_TEXTURE0 + Graphics::body_buffer_texture_unit);
+	glTexBufferRange(GL_TEXTURE_BUFFER, GL_RGBA32F, graphics->body_stream.id(),
+			 body_offset, graphics->body_stream.capacity());
+    }
 
-	float width = std::min(body0->radius(), body1->radius()) * 0.8;
-	
-	glm::vec2 sub = body1->pos - body0->pos;
-	glm::vec3 sub3(sub.x, sub.y, 0);
-	glm::vec4 sub4(sub.x, sub.y, 0, 0);
-	glm::vec3 orthsub = glm::normalize(glm::cross(sub3, glm::vec3(0, 0, 1))) * width;
-	glm::vec4 orthsub4(orthsub.x, orthsub.y, orthsub.z, 0);
-	glm::vec4 pos4(body0->pos.x, body0->pos.y, 0, 1);
- 
-	glm::mat4 model = glm::mat4();
-	// stretch & rotate
-	model[0] = orthsub4;
-	model[1] = sub4;
-	// translate
-	model[3] = pos4;
-	
-	glm::mat4 mvp = view * model;
-	glUniformMatrix4fv(graphics->program_vars.mvp, 1, false, &mvp[0][0]);
-	glBindVertexArray(graphics->attachment_model.vao);
-	glDrawArrays(GL_TRIANGLES, 0, 6);
-    });
+    // attachments, the quads are stretched between the bodies in attachment.vert
+    memcpy(graphics->attachment_stream.map(), snapshot.attachments.data(),
+	   snapshot.attachments.size() * sizeof(GLint));
+    GLintptr attachment_offset = graphics->attachment_stream.unmap();
+
+    graphics->attachment_program.bind();
+    glUniformMatrix4fv(graphics->attachment_program_vars.mvp, 1, false, &view[0][0]);
+    glBindVertexArray(graphics->attachment_model.vao);
+    set_attachment_instance_attributes(graphics, attachment_offset);
+    glDrawArraysInstanced(GL_TRIANGLES, 0, 6, snapshot.attachments.size() / 2);
+    graphics->program.bind();
 
-    // cells
-    glUniform1i(graphics->program_vars.tex, Graphics::cell_texture_unit);
+    // cells, the transform is built in the vertex shader.
+    // The instances are grouped by LOD, each group is drawn in one call.
+    float pixels_per_unit = glm::length(glm::vec2(view[0][0], view[0][1]))
+	* graphics->viewport_width / 2;
+    size_t lod_counts[CELL_LODS] = {};
+    for (RenderCell const &cell : snapshot.cells)
+	lod_counts[cell_lod(snapshot.bodies[cell.body].z * pixels_per_unit)]++;
+    size_t lod_firsts[CELL_LODS], lod_filled[CELL_LODS] = {};
+    lod_firsts[0] = 0;
+    for (int lod = 1; lod != CELL_LODS; ++lod)
+	lod_firsts[lod] = lod_firsts[lod - 1] + lod_counts[lod - 1];
 
-    logic->cells.iter().do_each([&](Cell *cell)
+    CellInstance *instances = (CellInstance *)graphics->cell_stream.map();
+    float tex_row_height = 1 / (float)graphics->cell_tex_rows;
+    for (RenderCell const &cell : snapshot.cells)
     {
-	Body *body = &cell->body();
-	
-	glm::mat4 model = glm::mat4();
-	model = glm::translate(model, glm::vec3(body->pos.x, body->pos.y, 0.f));
-	model = glm::rotate(model, body->angle, glm::vec3(0, 0, 1));
-	model = glm::scale(model, glm::vec3(body->radius(), body->radius(), 1));
-	
-       	glm::mat4 mvp = view * model;
-	glUniformMatrix4fv(graphics->program_vars.mvp, 1, false, &mvp[0][0]);
-	
-	glBindVertexArray(graphics->cell_model.vao);
+	glm::vec4 const &body = snapshot.bodies[cell.body];
+	int lod = cell_lod(body.z * pixels_per_unit);
+	CellInstance &instance = instances[lod_firsts[lod] + lod_filled[lod]++];
+	instance.x = body.x;
+	instance.y = body.y;
+	instance.angle = body.w;
+	instance.radius = body.z;
+	instance.overlay_color[0] = cell.fixed ? 0.2 : 0.0;
+	instance.overlay_color[1] = cell.charge * 0.3;
+	instance.overlay_color[2] = 0;
+	instance.overlay_color[3] = 0;
+	instance.tex_off_y = cell.type * tex_row_height;
+    }
+    GLintptr cell_offset = graphics->cell_stream.unmap();
+
+    set_cell_uniforms(graphics, graphics->program_vars, view, pixels_per_unit);
+    glBindVertexArray(graphics->cell_model.vao);
+    GLenum lod_modes[CELL_LODS] = {GL_TRIANGLE_FAN, GL_TRIANGLE_STRIP, GL_POINTS};
+    GLint lod_first_vertices[CELL_LODS] = {0, Graphics::cell_quad_first, Graphics::cell_point_first};
+    GLsizei lod_vertex_counts[CELL_LODS] = {Graphics::cell_vertex_count, 4, 1};
+    for (int lod = 0; lod != CELL_LODS; ++lod)
+    {
+	if (!lod_counts[lod])
+	    continue;
+	if (lod == CELL_LOD_QUAD)
+	{
+	    graphics->circle_program.bind();
+	    set_cell_uniforms(graphics, graphics->circle_program_vars, view, pixels_per_unit);
+	}
+	set_cell_instance_attributes(graphics, cell_offset + lod_firsts[lod] * sizeof(CellInstance));
+	glDrawArraysInstanced(lod_modes[lod], lod_first_vertices[lod], lod_vertex_counts[lod],
+			      lod_counts[lod]);
+	if (lod == CELL_LOD_QUAD)
+	    graphics->program.bind();
+    }
+
+    if (!snapshot.room_occupancy.empty())
+	render_room_heatmap(graphics, snapshot);
 
-	glUniform4f(graphics->program_vars.overlay_color,
-		    cell->body().fixed ? 0.2 : 0.0,
-		    cell->charge * 0.3,
-	            0, 0);
-	glUniform1f(graphics->program_vars.tex_off_y, (int)cell->type()._tag / (float)graphics->cell_tex_rows);
+    graphics->body_stream.fence();
+    graphics->attachment_stream.fence();
+    graphics->cell_stream.fence();
 
-	glDrawArrays(GL_TRIANGLE_FAN, 0, 20 + 1);
-    });
+    if (graphics->error_check == ERROR_CHECK_PER_FRAME)
+	check_gl_errors();
 }
@@ -6,14 +6,50 @@
 #include <vector>
 #include <glm/glm.hpp>
 
+/// How GL errors are found
+enum GLErrorCheck
+{
+    ERROR_CHECK_OFF,
+    /// asynchronous KHR_debug / ARB_debug_output callback,
+    /// falls back to ERROR_CHECK_PER_FRAME if the driver has neither
+    ERROR_CHECK_DEBUG_OUTPUT,
+    /// glGetError once after every frame
+    ERROR_CHECK_PER_FRAME,
+    /// glGetError after every GL call: finds the failing call, but stalls the pipeline
+    ERROR_CHECK_PER_CALL,
+};
+
+/// Chosen at build time (-> Makefile), overridden at startup by Graphics::error_check
+#ifndef DEFAULT_GL_ERROR_CHECK
+#define DEFAULT_GL_ERROR_CHECK ERROR_CHECK_DEBUG_OUTPUT
+#endif
+
+/// "off", "debug", "frame" or "call", false for anything else
+bool parse_gl_error_check(const char *name, GLErrorCheck *check);
+
 struct ProgramVars
 {
     gll::Uniform mvp;
     gll::Attribute vertXYZ;
     gll::Attribute vertUV;
+    gll::Attribute instPosAngleRadius;
+    gll::Attribute instOverlayColor;
+    gll::Attribute instTexOffY;
     gll::Uniform tex;
-    gll::Uniform tex_off_y;
-    gll::Uniform overlay_color;
+    gll::Uniform texRect;
+    gll::Uniform pixelsPerUnit;
+};
+
+/// The program of the attachment pass, it reads the bodies from a buffer texture
+struct AttachmentProgramVars
+{
+    gll::Uniform mvp;
+    gll::Attribute vertXYZ;
+    gll::Attribute vertUV;
+    gll::Attribute instBodies;
+    gll::Uniform tex;
+    gll::Uniform texRect;
+    gll::Uniform bodies;
 };
 
 struct Model
@@ -21,19 +57,115 @@ struct Model
     GLuint vbo, vao;
 };
 
+/// Per-instance data of the cell pass, layout of Graphics::cell_instance_vbo
+struct CellInstance
+{
+    float x, y, angle, radius;
+    float overlay_color[4];
+    float tex_off_y;
+};
+
+/// Cell of a RenderSnapshot
+struct RenderCell
+{
+    /// index into RenderSnapshot::bodies
+    GLint body;
+    GLint type;
+    float charge;
+    GLint fixed;
+};
+
+/// Result of the view culling of a RenderSnapshot
+struct CullStats
+{
+    size_t drawn_bodies = 0, culled_bodies = 0;
+    size_t drawn_cells = 0, culled_cells = 0;
+    size_t drawn_attachments = 0;
+};
+
+/// Everything render() needs of the worlds, copied on the simulation thread,
+/// so the render thread never touches the worlds.
+struct RenderSnapshot
+{
+    glm::mat4 view;
+    /// x, y, radius, angle of every body, the layout of the body buffer texture
+    std::vector<glm::vec4> bodies;
+    /// pairs of indices into bodies
+    std::vector<GLint> attachments;
+    std::vector<RenderCell> cells;
+    CullStats cull_stats;
+    /// to be set before capture_render_snapshot(): overlay the bodies per room
+    bool room_heatmap = false;
+    /// with room_heatmap: bodies in every room, room (x, y) at x + y * rooms_x
+    std::vector<uint16_t> room_occupancy;
+    int rooms_x = 0, rooms_y = 0;
+    float room_width = 0, room_height = 0;
+};
+
+/// Around the view, in world units
+constexpr float CULL_MARGIN = 5;
+
+/// Levels of detail of the cells, chosen by their radius on screen
+enum CellLOD
+{
+    /// textured triangle fan
+    CELL_LOD_FAN,
+    /// textured quad, the circle is cut out in the fragment shader
+    CELL_LOD_QUAD,
+    /// one point with the color of the center of the texture
+    CELL_LOD_POINT,
+    CELL_LODS
+};
+
 struct Graphics
 {
-    static constexpr GLuint cell_texture_unit = 0;
-    static constexpr GLuint attachment_texture_unit = 1;
-    static constexpr GLuint background_texture_unit = 2;
+    /// to be set before init_graphics()
+    GLErrorCheck error_check = DEFAULT_GL_ERROR_CHECK;
+    /// cell and attachment images (-> assets.hpp)
+    static constexpr GLuint atlas_texture_unit = 0;
+    static constexpr GLuint background_texture_unit = 1;
+    static constexpr GLuint body_buffer_texture_unit = 2;
+    static constexpr GLuint heatmap_texture_unit = 3;
+    gll::Program program, attachment_program;
     ProgramVars program_vars;
+    /// program with CIRCLE_MASK for the quad LOD, the only one that writes the depth
+    gll::Program circle_program;
+    ProgramVars circle_program_vars;
+    AttachmentProgramVars attachment_program_vars;
     Model cell_model, attachment_model, background_model;
-    GLuint cell_tex, attachment_tex, background_tex;
+    /// one texel per room, stretched over the world
+    Model heatmap_model;
+    GLuint atlas_tex, background_tex, heatmap_tex;
     int cell_tex_rows;
+    /// u, v, width, height of the cell image in the atlas
+    glm::vec4 cell_tex_rect;
+    /// The cell vbo holds the fan, the quad and the point of the LODs
+    static constexpr int cell_vertex_count = 20 + 2;
+    static constexpr int cell_quad_first = cell_vertex_count;
+    static constexpr int cell_point_first = cell_quad_first + 4;
+    /// radius on screen in pixels, below which the quad / point LOD is used
+    static constexpr float lod_quad_radius = 12;
+    static constexpr float lod_point_radius = 2;
+    int viewport_width, viewport_height;
+    /// CellInstances, all cells are drawn in one instanced call from this buffer
+    gll::StreamBuffer cell_stream;
+    /// x, y, radius, angle of every body, uploaded once per frame
+    gll::StreamBuffer body_stream;
+    GLuint body_buffer_tex;
+    /// pairs of body indices, all attachments are drawn in one instanced call
+    gll::StreamBuffer attachment_stream;
 };
 
 void init_graphics(Graphics *graphics, struct PhysicsWorld *physics);
-void render(Graphics *graphics, struct PhysicsWorld *physics, struct LogicWorld *logic,
-	    glm::mat4 const &view);
+void set_viewport(Graphics *graphics, int width, int height);
+/// Copy the visible part of the worlds into the snapshot, does not call GL.
+/// Only the bodies in view (plus a margin of CULL_MARGIN) are gathered, through
+/// the broadphase (-> query_area), so the cost depends on what is on screen,
+/// not on the size of the world.
+/// An attachment is drawn if one of its bodies is gathered, the body at its
+/// other end is then added to the bodies (without cell).
+void capture_render_snapshot(RenderSnapshot *snapshot, struct PhysicsWorld *physics,
+			     struct LogicWorld *logic, glm::mat4 const &view);
+void render(Graphics *graphics, RenderSnapshot const &snapshot);
 
 #endif
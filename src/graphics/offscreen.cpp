@@ -0,0 +1,305 @@
+#include "Logger.hpp"
+#include "offscreen.hpp"
+#include <cstring>
+#include <EGL/egl.h>
+#include <EGL/eglext.h>
+#include "CImg.h"
+
+using namespace cimg_library;
+
+bool create_offscreen_context(OffscreenContext *context)
+{
+    // the surfaceless platform needs neither display server nor GPU
+    EGLDisplay display = EGL_NO_DISPLAY;
+#ifdef EGL_PLATFORM_SURFACELESS_MESA
+    PFNEGLGETPLATFORMDISPLAYEXTPROC get_platform_display =
+	(PFNEGLGETPLATFORMDISPLAYEXTPROC)eglGetProcAddress("eglGetPlatformDisplayEXT");
+    if (get_platform_display)
+	display = get_platform_display(EGL_PLATFORM_SURFACELESS_MESA, EGL_DEFAULT_DISPLAY, nullptr);
+#endif
+    if (display == EGL_NO_DISPLAY)
+	display = eglGetDisplay(EGL_DEFAULT_DISPLAY);
+    EGLint major, minor;
+    if (display == EGL_NO_DISPLAY || !eglInitialize(display, &major, &minor))
+    {
+	LOG_MSG("Cannot initialize EGL");
+	return false;
+    }
+    const char *extensions = eglQueryString(display, EGL_EXTENSIONS);
+    if (!extensions || !strstr(extensions, "EGL_KHR_surfaceless_context"))
+    {
+	LOG_MSG("EGL_KHR_surfaceless_context is not supported");
+	eglTerminate(display);
+	return false;
+    }
+
+    // the default surface type is window, which the surfaceless platform has none of
+    EGLint const config_attributes[] = {
+	EGL_SURFACE_TYPE, EGL_PBUFFER_BIT,
+	EGL_RENDERABLE_TYPE, EGL_OPENGL_BIT,
+	EGL_NONE
+    };
+    EGLConfig config;
+    EGLint config_count = 0;
+    if (!eglBindAPI(EGL_OPENGL_API)
+	|| !eglChooseConfig(display, config_attributes, &config, 1, &config_count)
+	|| config_count == 0)
+    {
+	LOG_MSG("No EGL config for desktop OpenGL");
+	eglTerminate(display);
+	return false;
+    }
+    EGLContext egl_context = eglCreateContext(display, config, EGL_NO_CONTEXT, nullptr);
+    if (egl_context == EGL_NO_CONTEXT
+	|| !eglMakeCurrent(display, EGL_NO_SURFACE, EGL_NO_SURFACE, egl_context))
+    {
+	LOG_MSG("Cannot create the EGL context");
+	eglTerminate(display);
+	return false;
+    }
+    LOG_MSG("Offscreen EGL ", major, ".", minor, " context");
+    context->display = display;
+    context->context = egl_context;
+    return true;
+}
+
+void destroy_offscreen_context(OffscreenContext *context)
+{
+    if (!context->display)
+	return;
+    eglMakeCurrent(context->display, EGL_NO_SURFACE, EGL_NO_SURFACE, EGL_NO_CONTEXT);
+    eglDestroyContext(context->display, context->context);
+    eglTerminate(context->display);
+    context->display = context->context = nullptr;
+}
+
+/// Store the frame, on the writer thread
+bool write_frame(FrameWriter *writer, FrameWriter::Frame const &frame)
+{
+    int width = writer->width, height = writer->height;
+    if (!writer->png)
+    {
+	bool ok = true;
+	for (int y = height - 1; y >= 0; --y)
+	    ok = ok && fwrite(&frame.pixels[y * width * 4], 1, width * 4, writer->raw_file)
+		== (size_t)width * 4;
+	return ok;
+    }
+
+    // CImg stores the channels as planes, top row first
+    CImg<unsigned char> img(width, height, 1, 4);
+    for (int c = 0; c != 4; ++c)
+    {
+	unsigned char *plane = img.data(0, 0, 0, c);
+	for (int y = 0; y != height; ++y)
+	{
+	    unsigned char const *row = &frame.pixels[(height - 1 - y) * width * 4];
+	    for (int x = 0; x != width; ++x)
+		plane[y * width + x] = row[x * 4 + c];
+	}
+    }
+    char filename[1024];
+    snprintf(filename, sizeof(filename), writer->pattern.c_str(), frame.number);
+    try
+    {
+	img.save_png(filename);
+    }
+    catch (CImgException const &)
+    {
+	return false;
+    }
+    return true;
+}
+
+void frame_writer_loop(FrameWriter *writer)
+{
+    std::unique_lock<std::mutex> lock(writer->mutex);
+    while (true)
+    {
+	writer->wake_up.wait(lock, [&]() { return writer->quit || !writer->queue.empty(); });
+	if (writer->queue.empty())
+	    break;
+	FrameWriter::Frame frame = std::move(writer->queue.front());
+	writer->queue.pop_front();
+	writer->space.notify_one();
+
+	lock.unlock();
+	bool ok = write_frame(writer, frame);
+	lock.lock();
+
+	if (ok)
+	    writer->written++;
+	else if (writer->failed++ == 0)
+	    LOG_MSG("Cannot write frame ", frame.number);
+	writer->free_buffers.push_back(std::move(frame.pixels));
+    }
+}
+
+/// Whether the pattern is safe to pass to snprintf with the frame number:
+/// exactly one integer conversion (flags, width and precision allowed, no length
+/// modifier, no *), any other % only as %%
+bool is_frame_pattern(std::string const &pattern)
+{
+    int conversions = 0;
+    for (size_t i = 0; i != pattern.size(); ++i)
+    {
+	if (pattern[i] != '%')
+	    continue;
+	if (++i != pattern.size() && pattern[i] == '%')
+	    continue;
+	i = pattern.find_first_not_of("-+ #0", i);
+	i = pattern.find_first_not_of("0123456789", i);
+	if (i != std::string::npos && pattern[i] == '.')
+	    i = pattern.find_first_not_of("0123456789", i + 1);
+	if (i == std::string::npos || !strchr("diouxX", pattern[i]) || ++conversions > 1)
+	    return false;
+    }
+    return conversions == 1;
+}
+
+bool start_frame_writer(FrameWriter *writer, std::string const &pattern, int width, int height)
+{
+    writer->pattern = pattern;
+    writer->png = pattern.size() >= 4 && pattern.compare(pattern.size() - 4, 4, ".png") == 0;
+    if (writer->png && !is_frame_pattern(pattern))
+    {
+	LOG_MSG("The frame pattern ", pattern, " needs exactly one integer conversion"
+		" for the frame number (e.g. %06d) and no other % but %%");
+	return false;
+    }
+    writer->width = width;
+    writer->height = height;
+    if (!writer->png)
+    {
+	writer->raw_file = fopen(pattern.c_str(), "wb");
+	if (!writer->raw_file)
+	{
+	    LOG_MSG("Cannot open ", pattern, " for writing");
+	    return false;
+	}
+    }
+    writer->thread = std::thread(frame_writer_loop, writer);
+    return true;
+}
+
+void submit_frame(FrameWriter *writer, uint32_t number, unsigned char const *pixels)
+{
+    std::unique_lock<std::mutex> lock(writer->mutex);
+    writer->space.wait(lock, [&]() { return writer->queue.size() < FrameWriter::MAX_QUEUED; });
+    FrameWriter::Frame frame;
+    frame.number = number;
+    if (!writer->free_buffers.empty())
+    {
+	frame.pixels = std::move(writer->free_buffers.back());
+	writer->free_buffers.pop_back();
+    }
+    frame.pixels.assign(pixels, pixels + writer->width * writer->height * 4);
+    writer->queue.push_back(std::move(frame));
+    writer->wake_up.notify_one();
+}
+
+void stop_frame_writer(FrameWriter *writer)
+{
+    {
+	std::lock_guard<std::mutex> lock(writer->mutex);
+	writer->quit = true;
+    }
+    writer->wake_up.notify_one();
+    if (writer->thread.joinable())
+	writer->thread.join();
+    if (writer->raw_file)
+	fclose(writer->raw_file);
+    writer->raw_file = nullptr;
+    LOG_MSG("Wrote ", writer->written, " frames to ", writer->pattern);
+}
+
+bool create_offscreen_target(OffscreenTarget *target, int width, int height)
+{
+    target->width = width;
+    target->height = height;
+
+    glGenRenderbuffers(1, &target->color_buffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, target->color_buffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_RGBA8, width, height);
+    glGenRenderbuffers(1, &target->depth_buffer);
+    glBindRenderbuffer(GL_RENDERBUFFER, target->depth_buffer);
+    glRenderbufferStorage(GL_RENDERBUFFER, GL_DEPTH_COMPONENT24, width, height);
+
+    glGenFramebuffers(1, &target->fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, target->fbo);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_COLOR_ATTACHMENT0,
+			      GL_RENDERBUFFER, target->color_buffer);
+    glFramebufferRenderbuffer(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
+			      GL_RENDERBUFFER, target->depth_buffer);
+    if (glCheckFramebufferStatus(GL_FRAMEBUFFER) != GL_FRAMEBUFFER_COMPLETE)
+    {
+	LOG_MSG("Offscreen framebuffer is incomplete");
+	return false;
+    }
+
+    glGenBuffers(OffscreenTarget::PBO_COUNT, target->pbos);
+    for (int i = 0; i != OffscreenTarget::PBO_COUNT; ++i)
+    {
+	glBindBuffer(GL_PIXEL_PACK_BUFFER, target->pbos[i]);
+	glBufferData(GL_PIXEL_PACK_BUFFER, width * height * 4, nullptr, GL_STREAM_READ);
+	target->fences[i] = 0;
+	target->pending[i] = false;
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    target->next = 0;
+    return true;
+}
+
+/// Map the PBO (waiting for its transfer) and hand its frame to the writer
+void collect_frame(OffscreenTarget *target, FrameWriter *writer, int i)
+{
+    glClientWaitSync(target->fences[i], GL_SYNC_FLUSH_COMMANDS_BIT, GL_TIMEOUT_IGNORED);
+    glDeleteSync(target->fences[i]);
+    target->fences[i] = 0;
+
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, target->pbos[i]);
+    void *pixels = glMapBufferRange(GL_PIXEL_PACK_BUFFER, 0, target->width * target->height * 4,
+				    GL_MAP_READ_BIT);
+    if (pixels)
+    {
+	submit_frame(writer, target->frame_numbers[i], (unsigned char const *)pixels);
+	glUnmapBuffer(GL_PIXEL_PACK_BUFFER);
+    }
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    target->pending[i] = false;
+}
+
+void read_frame(OffscreenTarget *target, FrameWriter *writer, uint32_t number)
+{
+    int i = target->next;
+    if (target->pending[i])
+	collect_frame(target, writer, i);
+
+    glBindFramebuffer(GL_READ_FRAMEBUFFER, target->fbo);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, target->pbos[i]);
+    glReadPixels(0, 0, target->width, target->height, GL_RGBA, GL_UNSIGNED_BYTE, nullptr);
+    glBindBuffer(GL_PIXEL_PACK_BUFFER, 0);
+    target->fences[i] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    target->frame_numbers[i] = number;
+    target->pending[i] = true;
+    target->next = (i + 1) % OffscreenTarget::PBO_COUNT;
+}
+
+void flush_frames(OffscreenTarget *target, FrameWriter *writer)
+{
+    // oldest first
+    for (int k = 0; k != OffscreenTarget::PBO_COUNT; ++k)
+    {
+	int i = (target->next + k) % OffscreenTarget::PBO_COUNT;
+	if (target->pending[i])
+	    collect_frame(target, writer, i);
+    }
+}
+
+void destroy_offscreen_target(OffscreenTarget *target)
+{
+    glDeleteBuffers(OffscreenTarget::PBO_COUNT, target->pbos);
+    glDeleteFramebuffers(1, &target->fbo);
+    glDeleteRenderbuffers(1, &target->color_buffer);
+    glDeleteRenderbuffers(1, &target->depth_buffer);
+}
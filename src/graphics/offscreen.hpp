@@ -0,0 +1,93 @@
+#ifndef OFFSCREEN_HPP_INCLUDED
+#define OFFSCREEN_HPP_INCLUDED
+
+#include "GLL/GLL.hpp"
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// Headless rendering: a GL context without window or display
+/// (EGL on the surfaceless Mesa platform, e.g. llvmpipe), a framebuffer object
+/// to render into, asynchronous read back through pixel buffer objects and a
+/// writer thread that stores the frames.
+
+struct OffscreenContext
+{
+    void *display = nullptr;
+    void *context = nullptr;
+};
+
+/// Create the context and make it current, false (and logged) on failure
+bool create_offscreen_context(OffscreenContext *context);
+void destroy_offscreen_context(OffscreenContext *context);
+
+/// Writes frames on a thread of its own.
+/// Pattern ending in ".png": one PNG per frame, the pattern is a printf format
+/// for the frame number (e.g. "frames/%06d.png"), start_frame_writer() rejects
+/// patterns with other conversions.
+/// Otherwise, the frames are appended as raw RGBA (top row first) to the file
+/// named by the pattern, e.g. for ffmpeg -f rawvideo -pix_fmt rgba.
+struct FrameWriter
+{
+    /// frames waiting to be written, the renderer blocks while the queue is full
+    static constexpr size_t MAX_QUEUED = 8;
+
+    struct Frame
+    {
+	uint32_t number;
+	/// bottom row first, as read from GL
+	std::vector<unsigned char> pixels;
+    };
+
+    std::string pattern;
+    bool png = false;
+    FILE *raw_file = nullptr;
+    int width = 0, height = 0;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable wake_up, space;
+    std::deque<Frame> queue;
+    /// written frames, their pixels are reused
+    std::vector<std::vector<unsigned char>> free_buffers;
+    bool quit = false;
+    size_t written = 0, failed = 0;
+};
+
+bool start_frame_writer(FrameWriter *writer, std::string const &pattern, int width, int height);
+/// Copy the pixels (width * height RGBA, bottom row first) into the queue
+void submit_frame(FrameWriter *writer, uint32_t number, unsigned char const *pixels);
+/// Write the queued frames and join the thread
+void stop_frame_writer(FrameWriter *writer);
+
+/// Framebuffer object with a ring of pixel buffer objects.
+/// A frame is read into a PBO without waiting; it is only mapped and handed
+/// to the writer when its PBO comes around again, PBO_COUNT - 1 frames later,
+/// when the transfer is long done.
+struct OffscreenTarget
+{
+    static constexpr int PBO_COUNT = 3;
+
+    int width, height;
+    GLuint fbo, color_buffer, depth_buffer;
+    GLuint pbos[PBO_COUNT];
+    GLsync fences[PBO_COUNT];
+    uint32_t frame_numbers[PBO_COUNT];
+    bool pending[PBO_COUNT];
+    int next = 0;
+};
+
+/// Create the framebuffer and bind it for drawing
+bool create_offscreen_target(OffscreenTarget *target, int width, int height);
+/// Start reading the rendered frame, hands older frames to the writer
+void read_frame(OffscreenTarget *target, FrameWriter *writer, uint32_t number);
+/// Hand every frame still in flight to the writer
+void flush_frames(OffscreenTarget *target, FrameWriter *writer);
+void destroy_offscreen_target(OffscreenTarget *target);
+
+#endif
@@ -1,6 +1,8 @@
 #include "Logger.hpp"
 #include "logic.hpp"
 #include "physics/physics.hpp"
+#include "profiler/profiler.hpp"
+#include "util/det_math.hpp"
 #include <cmath>
 
 #define VAR(x) std::string(indent, ' ') << #x << ": " << (x) << "\n"
@@ -107,6 +109,28 @@ void print_logic(LogicWorld *logic)
 				});
 }
 
+ConcurrentSlot<Cell> *add_cell(LogicWorld *logic, Cell const &cell)
+{
+    ConcurrentSlot<Cell> *slot = logic->cells.add(cell);
+    slot->value().attachments.set_arena(&logic->arena);
+    slot->value().body().user_data = &slot->value();
+    std::vector<ConcurrentSlot<Cell> *> &bucket = logic->buckets[slot->value().type()._tag];
+    slot->value().bucket_index = bucket.size();
+    bucket.push_back(slot);
+    return slot;
+}
+
+/// Swap the cell with the last one of its bucket and pop it.
+void remove_from_bucket(LogicWorld *logic, ConcurrentSlot<Cell> *slot)
+{
+    std::vector<ConcurrentSlot<Cell> *> &bucket = logic->buckets[slot->value().type()._tag];
+    size_t i = slot->value().bucket_index;
+    assert(i < bucket.size() && bucket[i] == slot);
+    bucket[i] = bucket.back();
+    bucket[i]->value().bucket_index = i;
+    bucket.pop_back();
+}
+
 void init_logic_world(LogicWorld *logic, PhysicsWorld *physics)
 {
     AttachmentConfig child_att = AttachmentConfig();
@@ -178,18 +202,20 @@ void init_logic_world(LogicWorld *logic, PhysicsWorld *physics)
     Body first_body = Body();
     first_body.mass = 4;
     first_body.pos = glm::vec2(20, 20);
-    Slot<Body> *first_body_slot = physics->bodies.add(first_body);
+    ConcurrentSlot<Body> *first_body_slot = physics->bodies.add(first_body);
     
     Cell first_cell = Cell();
     first_cell.type_slot = orig_type_slot;
     first_cell.body_slot = first_body_slot;
     first_cell.life_time = 0;
-    logic->cells.add(first_cell);
+    add_cell(logic, first_cell);
+    logic->cells.publish();
+    publish_bodies(physics);
 }
 
-void kill_cell(Slot<Cell> *slot)
+void kill_cell(LogicWorld *logic, PhysicsWorld *physics, ConcurrentSlot<Cell> *slot)
 {
-    assert(!slot->empty);
+    remove_from_bucket(logic, slot);
     
     // needed: shared_ptr
     slot->value().type_slot = 0;
@@ -214,30 +240,25 @@ void kill_cell(Slot<Cell> *slot)
     }
 	
 
-    slot->value().body_slot->empty = true;
-    slot->empty = true;
+    remove_body(physics, slot->value().body_slot);
+    logic->cells.remove(slot);
+}
+
+/// How often the cell is attached to the other one
+size_t count_logic_attachments(Cell *cell, Cell *other)
+{
+    size_t occurences = 0;
+    for (Optional<LogicAttachment> const &la: cell->attachments)
+	if (!la.empty && la.value().other_cell == other)
+	    ++occurences;
+    return occurences;
 }
 
 bool are_cells_logic_attached(Cell *a, Cell *b)
 {
-    size_t occurences = iter(a->attachments)
-	.filter([&](Optional<LogicAttachment> *const &la)
-		{
-		    if (la->empty)
-			return false;
-		    return la->value().other_cell == b;
-		})
-	.count();
+    size_t occurences = count_logic_attachments(a, b);
     assert(occurences < 2);
-    
-    assert(iter(b->attachments)
-	   .filter([&](Optional<LogicAttachment> *const &la)
-		   {
-		       if (la->empty)
-			   return false;
-		       return la->value().other_cell == a;
-		   })
-	   .count() == occurences);
+    assert(count_logic_attachments(b, a) == occurences);
 
     return occurences == 1;
 }
@@ -284,159 +305,170 @@ void on_cell_create(LogicWorld *, PhysicsWorld *, Cell *cell)
     }
 }
 
-void update_cell(LogicWorld *logic, PhysicsWorld *physics, Slot<Cell> *slot, float time)
+/// Split the stem cell into its two children, which replace it
+void split_stem_cell(LogicWorld *logic, PhysicsWorld *physics, ConcurrentSlot<Cell> *slot)
 {
     Cell &cell = slot->assert_value();
-    cell.life_time+= time;
-    CellType &cell_type = cell.type();
-    
-    switch (cell_type._tag)
-    {
-    case CellType::STEM_CELL:
+    StemCell &stem_cell = cell.type().stem_cell;
+    float parent_mass = cell.body().mass;
+
+    ConcurrentSlot<Cell> *children[2];
+    for (int i = 0; i != 2; ++i)
     {
-	float const split_cool_down = 3;
-		
-	StemCell &stem_cell = cell_type.stem_cell;
-	float parent_mass = cell.body().mass;
-       	if (cell.life_time > split_cool_down && parent_mass > stem_cell.min_split_mass)
+	Body child_body = Body();
+	child_body.angle = cell.body().angle + stem_cell.children_angles[i];
+	child_body.angle_vel = 0;
+	child_body.mass = abs((i - stem_cell.child0_amount) * parent_mass);
+	child_body.mass_per_radius = 1;
+	glm::vec2 dir = glm::vec2(det_cos(cell.body().angle + 0.5 * M_PI * (i * 2 - 1)),
+				  det_sin(cell.body().angle + 0.5 * M_PI * (i * 2 - 1)))
+	                * child_body.radius()
+	                * 0.1f; // so that the cells have to repulse first, cool effect 
+	child_body.pos = cell.body().pos + dir;
+	child_body.vel = glm::vec2();
+	assert(BodyRooms::no_negative_rooms);
+	child_body.room_x = child_body.room_y = -1;
+	child_body.sweep_index = -1;
+	ConcurrentSlot<Body> *child_body_slot = physics->bodies.add(child_body);
+
+	Cell child_cell = Cell();
+	child_cell.type_slot = stem_cell.children_types[i];
+	child_cell.body_slot = child_body_slot;
+	child_cell.life_time = 0;
+	children[i] = add_cell(logic, child_cell);
+
+	for (size_t passing_att: stem_cell.passed_attachments[i])
 	{
-	    Slot<Cell> *children[2];
-    	    for (int i = 0; i != 2; ++i)
-	    {
-		Body child_body = Body();
-		child_body.angle = cell.body().angle + stem_cell.children_angles[i];
-		child_body.angle_vel = 0;
-		child_body.mass = abs((i - stem_cell.child0_amount) * parent_mass);
-       		child_body.mass_per_radius = 1;
-		glm::vec2 dir = glm::vec2(cos(cell.body().angle + 0.5 * M_PI * (i * 2 - 1)),
-		                          sin(cell.body().angle + 0.5 * M_PI * (i * 2 - 1)))
-		                * child_body.radius()
-		                * 0.1f; // so that the cells have to repulse first, cool effect 
-		child_body.pos = cell.body().pos + dir;
-		child_body.vel = glm::vec2();
-		assert(BodyRooms::no_negative_rooms);
-		child_body.room_x = child_body.room_y = -1;
-		Slot<Body> *child_body_slot = physics->bodies.add(child_body);
-
-		Cell child_cell = Cell();
-		child_cell.type_slot = stem_cell.children_types[i];
-		child_cell.body_slot = child_body_slot;
-		child_cell.life_time = 0;
-		child_cell.attachments.reserve(stem_cell.passed_attachments[i].size() + 1);
-		children[i] = logic->cells.add(child_cell);
-
-		for (size_t passing_att: stem_cell.passed_attachments[i])
-		{
-		    if (passing_att >= cell.attachments.size())
-			continue;
-		    Optional<LogicAttachment> &parent_att = cell.attachments[passing_att];
-		    if (parent_att.empty)
-			continue;
-
-		    attach_cells(logic, physics,
-				 &children[i]->value(), parent_att.value().other_cell,
-				 parent_att.value().physics->assert_value().config);
-		}
-	    }
+	    if (passing_att >= cell.attachments.size())
+		continue;
+	    Optional<LogicAttachment> &parent_att = cell.attachments[passing_att];
+	    if (parent_att.empty)
+		continue;
+
+	    attach_cells(logic, physics,
+			 &children[i]->value(), parent_att.value().other_cell,
+			 parent_att.value().physics->assert_value().config);
+	}
+    }
 
-	    if (!stem_cell.optional_child_attachment.empty)
-		attach_cells(logic, physics, &children[0]->value(), &children[1]->value(),
-			     stem_cell.optional_child_attachment.value());
+    if (!stem_cell.optional_child_attachment.empty)
+	attach_cells(logic, physics, &children[0]->value(), &children[1]->value(),
+		     stem_cell.optional_child_attachment.value());
 
-	    // martyr mother commits suicide for her children :'(
-	    kill_cell(slot);
+    // martyr mother commits suicide for her children :'(
+    kill_cell(logic, physics, slot);
 
-	    on_cell_create(logic, physics, &children[0]->value());
-	    on_cell_create(logic, physics, &children[1]->value());
-	}
-	break;    
+    on_cell_create(logic, physics, &children[0]->value());
+    on_cell_create(logic, physics, &children[1]->value());
+}
+
+/// Batch kernel of the stem cells: age them and split the ripe ones.
+/// Splitting modifies the buckets, so the ripe cells are collected first.
+void update_stem_cells(LogicWorld *logic, PhysicsWorld *physics, float time)
+{
+    float const split_cool_down = 3;
+
+    std::vector<ConcurrentSlot<Cell> *> &bucket = logic->buckets[CellType::STEM_CELL];
+    logic->splitting_cells.clear();
+    for (ConcurrentSlot<Cell> *slot: bucket)
+    {
+	Cell &cell = slot->value();
+	cell.life_time+= time;
+	if (cell.life_time > split_cool_down
+	    && cell.body().mass > cell.type().stem_cell.min_split_mass)
+	    logic->splitting_cells.push_back(slot);
     }
-    case CellType::MUSCLE_CELL:
+
+    for (ConcurrentSlot<Cell> *slot: logic->splitting_cells)
+	split_stem_cell(logic, physics, slot);
+}
+
+/// Batch kernel of the muscle cells: fix bodies and control attachment distances
+void update_muscle_cells(LogicWorld *logic, float time)
+{
+    for (ConcurrentSlot<Cell> *slot: logic->buckets[CellType::MUSCLE_CELL])
     {
+	Cell &cell = slot->value();
+	cell.life_time+= time;
+
 	if (cell.charge != 0)
 	    LOG_DEBUG("why tf am I charged?!?!");
-	MuscleCellType &muscle = cell_type.muscle_cell;
+	MuscleCellType &muscle = cell.type().muscle_cell;
 	if (!muscle.fix_input_attachment.empty)
 	    cell.attachment(muscle.fix_input_attachment.value())
 	        .do_value([&](LogicAttachment &la)
 	        {
 	            cell.body().fixed = la.other_cell->charge > 0.5;
 	        });
-	iter(muscle.control_inputs)
-	    .filter([&](MuscleInput *input)
-		    {
-			return !cell.attachment(input->input_attachment).empty
-			    && !cell.attachment(input->output_attachment).empty;
-		    })
-	    .do_each([&](MuscleInput *input)
-	    {
-		Attachment &output = cell.attachment(input->output_attachment).value()
-		    .physics->assert_value();
-		output.config.distance = cell.attachment(input->input_attachment).value()
-		    .other_cell->charge * input->weight;
-		static float last_distance = -1;
-		if (output.config.distance != last_distance)
-		{
-		    last_distance = output.config.distance;
-		    // LOG_DEBUG("set distance to ", output.config.distance);
-		}
-	    });
-	break;
+	for (MuscleInput const &input: muscle.control_inputs)
+	{
+	    if (cell.attachment(input.input_attachment).empty
+		|| cell.attachment(input.output_attachment).empty)
+		continue;
+	    Attachment &output = cell.attachment(input.output_attachment).value()
+		.physics->assert_value();
+	    output.config.distance = cell.attachment(input.input_attachment).value()
+		.other_cell->charge * input.weight;
+	}
     }
-    case CellType::NEURON_CELL:
+}
+
+/// Batch kernel of the neuron cells: fire the neurons whose update is due
+void update_neuron_cells(LogicWorld *logic, float time)
+{
+    for (ConcurrentSlot<Cell> *slot: logic->buckets[CellType::NEURON_CELL])
     {
+	Cell &cell = slot->value();
+	cell.life_time+= time;
+
         if (cell.body().fixed)
 	    LOG_DEBUG("why tf am I fixed?!?!?!");
 	cell.neuron_next_update-= time;
-	if (cell.neuron_next_update < 0)
+	if (cell.neuron_next_update >= 0)
+	    continue;
+	cell.neuron_next_update = 1;
+
+	NeuronCellType &neuron = cell.type().neuron_cell;
+	float weighted_input = 0;
+	for (size_t i = 0; i != neuron.inputs.size(); ++i)
 	{
-	    cell.neuron_next_update = 1;
-
-	    NeuronCellType &neuron = cell_type.neuron_cell;
-	    float weighted_input = iter(neuron.inputs)
-		.fold(0, [&](float acc, NeuronInput const* input)
-		      {
-			  if (input->attachment >= cell.attachments.size())
-			      return acc;
-			  return acc + input->weight *
-			       cell.attachments[input->attachment]
-			       .map([](LogicAttachment const &attachment)
-			       {
-				   return attachment.other_cell->charge;
-			       }).value_or(0);    
-		      });
-	    weighted_input = 0;
-	    for (size_t i = 0; i != neuron.inputs.size(); ++i)
-	    {
-		if (neuron.inputs[i].attachment >= cell.attachments.size())
-		    continue;
-		if (cell.attachments[neuron.inputs[i].attachment].empty)
-		    continue;
-		weighted_input+= neuron.inputs[i].weight
-		    * cell.attachments[neuron.inputs[i].attachment].value().other_cell->charge;
-	    }
-	    switch (neuron.function)
-	    {
-	    case NeuronCellType::Function::STEP:
-		cell.charge = weighted_input > neuron.threshold ? 1 : 0;
-		break;
-	    case NeuronCellType::Function::SIGMOID:
-		cell.charge = 1 / (1 + pow(M_E, -(weighted_input - neuron.threshold)));
-		break;
-	    case NeuronCellType::Function::LINEAR:
-		cell.charge = (weighted_input - neuron.threshold);
-		break;
-	    }
+	    if (neuron.inputs[i].attachment >= cell.attachments.size())
+		continue;
+	    if (cell.attachments[neuron.inputs[i].attachment].empty)
+		continue;
+	    weighted_input+= neuron.inputs[i].weight
+		* cell.attachments[neuron.inputs[i].attachment].value().other_cell->charge;
+	}
+	switch (neuron.function)
+	{
+	case NeuronCellType::Function::STEP:
+	    cell.charge = weighted_input > neuron.threshold ? 1 : 0;
+	    break;
+	case NeuronCellType::Function::SIGMOID:
+	    cell.charge = 1 / (1 + det_exp(-(weighted_input - neuron.threshold)));
+	    break;
+	case NeuronCellType::Function::LINEAR:
+	    cell.charge = (weighted_input - neuron.threshold);
+	    break;
 	}
-	break;
-    }
     }
 }
 
 void update_logic(LogicWorld *logic, PhysicsWorld *physics, float time)
 {
-    logic->cells.iter_nonempty_slots().do_each([&](Slot<Cell> *slot)
     {
-        update_cell(logic, physics, slot, time);
-    });
+	PROFILE_SCOPE("logic stem cells");
+	update_stem_cells(logic, physics, time);
+    }
+    {
+	PROFILE_SCOPE("logic muscle cells");
+	update_muscle_cells(logic, time);
+    }
+    {
+	PROFILE_SCOPE("logic neuron cells");
+	update_neuron_cells(logic, time);
+    }
+    // the cells and bodies born and died in this update
+    logic->cells.publish();
+    publish_bodies(physics);
 }
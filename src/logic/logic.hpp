@@ -4,13 +4,19 @@
 #include <physics/physics.hpp>
 #include "Optional.hpp"
 #include "slots.hpp"
+#include "util/small_vector.hpp"
 #include <map>
 #include <memory>
 #include <new>
 #include <utility>
+#include <vector>
 
 size_t constexpr MAX_CELLS = MAX_BODIES;
 #define MAX_CELL_TYPES 50
+/// Inline capacities of the per-cell and per-type lists, sized for the typical degree.
+/// Longer lists go to the arena of the LogicWorld.
+#define INLINE_CELL_ATTACHMENTS 4
+#define INLINE_TYPE_INPUTS 2
 
 struct StemCell
 {
@@ -21,7 +27,7 @@ struct StemCell
     /// its index is the smallest number that is not already
     /// used for this child (thus ids are local, not global!)
     /// Now, there are two vectors, for each child separately.
-    std::vector<size_t> passed_attachments[2];
+    SmallVector<size_t, INLINE_TYPE_INPUTS> passed_attachments[2];
     /// the children will be positioned left and right to the parental cell
     /// (with respect to the parent angle)
     /// this member specifies the orientations of the children RELATIVE to the parental cell
@@ -50,7 +56,7 @@ struct MuscleCellType
     /// If the charge of the attached cell is near zero, this MuscleCellType will release.
     Optional<size_t> fix_input_attachment;
     /// this vector specifies which input charge attachments control which output attachments
-    std::vector<MuscleInput> control_inputs; 
+    SmallVector<MuscleInput, INLINE_TYPE_INPUTS> control_inputs;
 };
 
 struct NeuronInput
@@ -68,7 +74,7 @@ struct NeuronCellType
 	LINEAR,
     } function = STEP;
     float threshold = 0.5;
-    std::vector<NeuronInput> inputs;
+    SmallVector<NeuronInput, INLINE_TYPE_INPUTS> inputs;
 
     float update_offset = 0;
 };
@@ -150,6 +156,9 @@ struct CellType
     }
 };
 
+/// Number of CellType::CellTypeTag values, one bucket per tag (-> LogicWorld::buckets)
+size_t constexpr CELL_TYPE_TAGS = 3;
+
 /// One-sided attachment reference.
 struct LogicAttachment
 {
@@ -160,10 +169,10 @@ struct LogicAttachment
 struct Cell
 {
     Slot<CellType> *type_slot;
-    Slot<Body> *body_slot;
+    ConcurrentSlot<Body> *body_slot;
     // order matters. the attachment indices are used by stem_cell for attachment propagation
     // however, to be able to remove an attachment, the elements are optionals
-    std::vector<Optional<LogicAttachment>> attachments;
+    SmallVector<Optional<LogicAttachment>, INLINE_CELL_ATTACHMENTS> attachments;
     /// how long this cell is living now (seconds)
     float life_time = 0;
     /// Used to communicate (and, for neurons, compute) with other cells.
@@ -172,6 +181,9 @@ struct Cell
 
     float neuron_next_update = 0;
 
+    /// Position of this cell in the bucket of its type tag (-> LogicWorld::buckets)
+    size_t bucket_index = 0;
+
     Body &body()
     {
 	return body_slot->assert_value();
@@ -202,11 +214,25 @@ struct Cell
 
 struct LogicWorld
 {
-    Slots<Cell, MAX_CELLS> cells;
+    /// Overflow storage of the cell attachment lists, has to outlive the cells.
+    SmallVectorArena arena;
+    /// Added cells are only iterated after cells.publish() (-> update_logic)
+    ConcurrentSlots<Cell, MAX_CELLS> cells;
     Slots<CellType, MAX_CELL_TYPES> cell_types;
+    /// The living cells, grouped densely by the tag of their type,
+    /// so that each cell type is updated in a pass of its own.
+    /// Kept up to date by add_cell() and kill_cell().
+    std::vector<ConcurrentSlot<Cell> *> buckets[CELL_TYPE_TAGS];
+    /// Scratch list of the stem cells that split in the current update
+    std::vector<ConcurrentSlot<Cell> *> splitting_cells;
 };
 
+/// Print the type and its parameters to std::cout, indented by indent spaces
+void print_type(CellType const &type, int indent);
 void init_logic_world(LogicWorld *logic, PhysicsWorld *physics);
 void update_logic(LogicWorld *logic, PhysicsWorld *physics, float time);
+/// Add the cell to the world and to the bucket of its type.
+/// The attachments of the cell will overflow into the arena of the world.
+ConcurrentSlot<Cell> *add_cell(LogicWorld *logic, Cell const &cell);
 
 #endif
@@ -3,30 +3,117 @@
 #include <cstdlib>
 #include <iostream>
 #include "physics/physics.hpp"
+#include "physics/query.hpp"
 #include "graphics/graphics.hpp"
+#include "graphics/offscreen.hpp"
 #include "logic/logic.hpp"
+#include "snapshot/snapshot.hpp"
+#include "record/recorder.hpp"
+#include "snapshot/state_hash.hpp"
+#include "batch/batch.hpp"
+#include "util/triple_buffer.hpp"
+#include "profiler/profiler.hpp"
 #include "string.h"
 #include "time.h"
 #include "sleep.h"
 #include <functional>
 #include "input_utils.hpp"
 #include <iomanip>
+#include <memory>
+#include <thread>
+#include <atomic>
 
 using namespace input_utils;
 
 #define GLFW_INCLUDE_NONE
 #include "GLFW/glfw3.h"
 
-PhysicsWorld physics;
-LogicWorld logic;
+/// The worlds that are shown and the state of the view on them.
+/// The GLFW callbacks get it through the user pointer of the window.
+struct Session
+{
+    PhysicsWorld physics;
+    LogicWorld logic;
 
-bool mouse_down = false;
-glm::mat4 view;
-glm::vec2 last_cursor;
-ViewConfig viewconfig;
-int w = 800, h = 600;
+    bool mouse_down = false;
+    glm::mat4 view;
+    glm::vec2 last_cursor;
+    ViewConfig viewconfig;
+    int w = 800, h = 600;
+    /// set by the C key, the culling statistics of the next snapshot are printed
+    bool print_cull_stats = false;
+    /// set by the P key, the profile so far is printed (with --profile)
+    bool print_profile = false;
+    /// set by the R key, the room telemetry of the next step is printed
+    bool print_telemetry = false;
+    /// toggled by the H key or set by --heatmap, overlay the bodies per room
+    bool show_room_heatmap = false;
+};
 
-int main(int argc, char **argv)
+/// The point of the world under the cursor
+glm::vec2 cursor_world_pos(Session const *session)
+{
+    glm::vec2 ndc = session->last_cursor / glm::vec2(session->w, session->h) * 2.f - glm::vec2(1, 1);
+    ndc.y = -ndc.y;
+    glm::vec4 world = glm::inverse(session->view) * glm::vec4(ndc.x, ndc.y, 0, 1);
+    return glm::vec2(world.x, world.y) / world.w;
+}
+
+/// Print the body under the cursor and its cell, on a right click
+void print_picked_body(Session const *session)
+{
+    glm::vec2 pos = cursor_world_pos(session);
+    Body const *body = pick_body(&session->physics, pos);
+    if (!body)
+    {
+	std::cout << "no body at " << pos.x << ", " << pos.y << "\n";
+	return;
+    }
+    std::cout << "body at " << body->pos.x << ", " << body->pos.y << " radius " << body->radius()
+	      << " mass " << body->mass << (body->fixed ? " fixed" : "") << "\n";
+    if (!body->user_data)
+	return;
+    Cell const *cell = (Cell const *)body->user_data;
+    size_t attachments = 0;
+    for (Optional<LogicAttachment> const &attachment : cell->attachments)
+	attachments+= !attachment.empty;
+    std::cout << "cell: life time " << cell->life_time << " charge " << cell->charge
+	      << " attachments " << attachments << "\n";
+    print_type(cell->type(), 2);
+}
+
+/// Renders the latest published snapshot, independent of the simulation rate.
+/// Owns the GL context while running, events are still polled on the main thread.
+struct RenderThread
+{
+    std::thread thread;
+    std::atomic<bool> quit{false};
+    TripleBuffer<RenderSnapshot> snapshots;
+};
+
+void render_loop(RenderThread *render_thread, Graphics *graphics, GLFWwindow *window,
+		 int width, int height)
+{
+    set_profile_thread_name("render");
+    glfwMakeContextCurrent(window);
+    gll::useCurrentContext();
+    glfwSwapInterval(1);
+    set_viewport(graphics, width, height);
+
+    while (!render_thread->quit.load(std::memory_order_relaxed))
+    {
+	// without a new snapshot, the last one is drawn again, swapping waits for vsync
+	render_thread->snapshots.update();
+	render(graphics, render_thread->snapshots.read_buffer());
+	PROFILE_SCOPE("swap buffers");
+	glfwSwapBuffers(window);
+    }
+    glfwMakeContextCurrent(0);
+}
+
+/// Simulate and show the worlds in a window until it is closed
+int run_window(Session *session, GLErrorCheck gl_error_check,
+	       std::function<void(float)> const &simulate)
 {
     // init glfw
     if (!glfwInit())
@@ -34,57 +121,73 @@ int main(int argc, char **argv)
     std::atexit(glfwTerminate);
 
     glfwWindowHint(GLFW_SAMPLES, 4);
-    GLFWwindow *window = glfwCreateWindow(w, h, "float", 0, 0);
+    if (gl_error_check == ERROR_CHECK_DEBUG_OUTPUT)
+	glfwWindowHint(GLFW_OPENGL_DEBUG_CONTEXT, GLFW_TRUE);
+    GLFWwindow *window = glfwCreateWindow(session->w, session->h, "float", 0, 0);
     if (!window)
-	exit(-1);
-
-    view = glm::mat4();
-    view[0] = glm::vec4(0.1, 0, 0, 0);
-    view[1] = glm::vec4(0, 0.1, 0, 0);
-    view[2] = glm::vec4(0, 0, 1, 0);
-    view[3] = glm::vec4(-2, -2, 0, 1);
+	return -1;
+    glfwSetWindowUserPointer(window, session);
 
-    viewconfig.trans_per_mouse_move = 3 / (float)w;
-    viewconfig.zoom_per_scroll = 1.1;
+    session->viewconfig.trans_per_mouse_move = 3 / (float)session->w;
+    session->viewconfig.zoom_per_scroll = 1.1;
 
-    glfwSetKeyCallback(window, [](GLFWwindow *, int key, int scancode, int action, int mods){});
-    glfwSetMouseButtonCallback(window, [](GLFWwindow *, int key, int action, int mods)
+    glfwSetKeyCallback(window, [](GLFWwindow *window, int key, int scancode, int action, int mods)
+		       {
+			   Session *session = (Session *)glfwGetWindowUserPointer(window);
+			   if (key == GLFW_KEY_C && action == GLFW_PRESS)
+			       session->print_cull_stats = true;
+			   if (key == GLFW_KEY_P && action == GLFW_PRESS)
+			       session->print_profile = true;
+			   if (key == GLFW_KEY_R && action == GLFW_PRESS)
+			       session->print_telemetry = session->physics.telemetry.enabled = true;
+			   if (key == GLFW_KEY_H && action == GLFW_PRESS)
+			       session->show_room_heatmap = !session->show_room_heatmap;
+		       });
+    glfwSetMouseButtonCallback(window, [](GLFWwindow *window, int key, int action, int mods)
 			       {
-				   if (key == GLFW_MOUSE_BUTTON_LEFT)				      				        mouse_down = action == GLFW_PRESS;
+				   Session *session = (Session *)glfwGetWindowUserPointer(window);
+				   if (key == GLFW_MOUSE_BUTTON_LEFT)
+				       session->mouse_down = action == GLFW_PRESS;
+				   if (key == GLFW_MOUSE_BUTTON_RIGHT && action == GLFW_PRESS)
+				       print_picked_body(session);
 			       });
-    glfwSetCursorPosCallback(window, [](GLFWwindow *, double x, double y)
+    glfwSetCursorPosCallback(window, [](GLFWwindow *window, double x, double y)
 			     {
+				 Session *session = (Session *)glfwGetWindowUserPointer(window);
 				 glm::vec2 cursor(x, y);
 				 
-				 if (mouse_down)
+				 if (session->mouse_down)
 				 {
-				     glm::vec2 motion = cursor - last_cursor;
+				     glm::vec2 motion = cursor - session->last_cursor;
 				     motion.y = -motion.y;
-				     mouse_move(view, motion, viewconfig);
+				     mouse_move(session->view, motion, session->viewconfig);
 				 }
 				     
-				 last_cursor = cursor;
+				 session->last_cursor = cursor;
 			     });
-    glfwSetScrollCallback(window, [](GLFWwindow *, double, double y)
+    glfwSetScrollCallback(window, [](GLFWwindow *window, double, double y)
 			  {
-			      glm::vec2 wsize(w, h);
-			      glm::vec2 convcurs = last_cursor / wsize * 2.f - glm::vec2(1, 1);
+			      Session *session = (Session *)glfwGetWindowUserPointer(window);
+			      glm::vec2 wsize(session->w, session->h);
+			      glm::vec2 convcurs = session->last_cursor / wsize * 2.f - glm::vec2(1, 1);
 			      convcurs.y = -convcurs.y;
-			      scroll(view, y, convcurs, viewconfig);
+			      scroll(session->view, y, convcurs, session->viewconfig);
 			  });
     
     glfwMakeContextCurrent(window);
-    
-    // init physics
-    init_physics(&physics);
 
-    // init logic
-    init_logic_world(&logic, &physics);
-
-    // init graphics
+    // init graphics, then hand the context over to the render thread
     Graphics graphics;
-    init_graphics(&graphics, &physics);
-    glViewport(0, 0, w, h);
+    graphics.error_check = gl_error_check;
+    init_graphics(&graphics, &session->physics);
+    glfwMakeContextCurrent(0);
+    // holds three snapshots, keep it off the stack
+    std::unique_ptr<RenderThread> render_thread(new RenderThread());
+    capture_render_snapshot(&render_thread->snapshots.write_buffer(), &session->physics, &session->logic,
+			    session->view);
+    render_thread->snapshots.publish();
+    render_thread->thread = std::thread(render_loop, render_thread.get(), &graphics, window,
+					session->w, session->h);
     
     double min_frame_time = 1 / 30.f;
     double frame_start = glfwGetTime() - min_frame_time;
@@ -96,11 +199,33 @@ int main(int argc, char **argv)
 	// for debugging
 	elapsed_time = min_frame_time;
 
-	update_logic(&logic, &physics, elapsed_time);
-	update_physics(&physics, elapsed_time);
-	render(&graphics, &physics, &logic, view);
-	
-	glfwSwapBuffers(window);
+	simulate(elapsed_time);
+	if (session->print_telemetry)
+	{
+	    print_room_telemetry(std::cout, session->physics.telemetry);
+	    session->print_telemetry = session->physics.telemetry.enabled = false;
+	}
+	RenderSnapshot &snapshot = render_thread->snapshots.write_buffer();
+	snapshot.room_heatmap = session->show_room_heatmap;
+	capture_render_snapshot(&snapshot, &session->physics, &session->logic, session->view);
+	if (session->print_cull_stats)
+	{
+	    CullStats const &stats = snapshot.cull_stats;
+	    std::cout << "drawn: " << stats.drawn_bodies << " bodies, "
+		      << stats.drawn_cells << " cells, "
+		      << stats.drawn_attachments << " attachments; culled: "
+		      << stats.culled_bodies << " bodies, "
+		      << stats.culled_cells << " cells\n";
+	    session->print_cull_stats = false;
+	}
+	render_thread->snapshots.publish();
+	if (session->print_profile)
+	{
+	    if (profiler_enabled)
+		print_profile_stats(std::cout);
+	    session->print_profile = false;
+	}
+
 	glfwPollEvents();
 
 	double sleep_time = min_frame_time - (glfwGetTime() - frame_start);
@@ -109,4 +234,231 @@ int main(int argc, char **argv)
 	else if (sleep_time < -min_frame_time / 2)
 	    std::cout << "we are lagging behind by " << -sleep_time << " seconds!!!\n";
     }
+
+    render_thread->quit = true;
+    render_thread->thread.join();
+    return 0;
+}
+
+/// Simulate the given number of steps without display,
+/// render every frame_interval-th step into an image sequence (-> offscreen.hpp)
+int run_offscreen(Session *session, const char *frame_pattern, int steps, int frame_interval,
+		  GLErrorCheck gl_error_check, std::function<void(float)> const &simulate)
+{
+    OffscreenContext context;
+    if (!create_offscreen_context(&context))
+	return -1;
+    int result = -1;
+    Graphics graphics;
+    graphics.error_check = gl_error_check;
+    init_graphics(&graphics, &session->physics);
+    OffscreenTarget target;
+    FrameWriter writer;
+    if (create_offscreen_target(&target, session->w, session->h))
+    {
+	if (start_frame_writer(&writer, frame_pattern, session->w, session->h))
+	{
+	    set_viewport(&graphics, session->w, session->h);
+	    RenderSnapshot snapshot;
+	    float const elapsed_time = 1 / 30.f;
+	    uint32_t frame = 0;
+	    for (int step = 0; step < steps; ++step)
+	    {
+		simulate(elapsed_time);
+		if (step % frame_interval != 0)
+		    continue;
+		snapshot.room_heatmap = session->show_room_heatmap;
+		capture_render_snapshot(&snapshot, &session->physics, &session->logic, session->view);
+		render(&graphics, snapshot);
+		PROFILE_SCOPE("read frame");
+		read_frame(&target, &writer, frame++);
+	    }
+	    flush_frames(&target, &writer);
+	    stop_frame_writer(&writer);
+	    result = 0;
+	}
+	destroy_offscreen_target(&target);
+    }
+    destroy_offscreen_context(&context);
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    // command line
+    const char *snapshot_file = 0;
+    const char *checkpoint_file = 0;
+    const char *record_file = 0;
+    const char *hash_log_file = 0;
+    const char *offscreen_pattern = 0;
+    const char *profile_prefix = 0;
+    float fixed_room_size = 0;
+    int offscreen_steps = 1000;
+    int frame_interval = 1;
+    GLErrorCheck gl_error_check = DEFAULT_GL_ERROR_CHECK;
+    const char *batch_file = 0;
+    const char *batch_csv_file = 0;
+    unsigned batch_threads = 0;
+    // the worlds are big, keep them off the stack
+    std::unique_ptr<Session> session(new Session());
+    PhysicsWorld &physics = session->physics;
+    LogicWorld &logic = session->logic;
+    for (int i = 1; i < argc; ++i)
+    {
+	if (strcmp(argv[i], "--snapshot") == 0 && i + 1 < argc)
+	    snapshot_file = argv[++i];
+	else if (strcmp(argv[i], "--checkpoint") == 0 && i + 1 < argc)
+	    checkpoint_file = argv[++i];
+	else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc)
+	    record_file = argv[++i];
+	else if (strcmp(argv[i], "--hash-log") == 0 && i + 1 < argc)
+	    hash_log_file = argv[++i];
+	else if (strcmp(argv[i], "--gl-errors") == 0 && i + 1 < argc
+		 && parse_gl_error_check(argv[i + 1], &gl_error_check))
+	    ++i;
+	else if (strcmp(argv[i], "--deterministic") == 0)
+	    physics.deterministic = true;
+	else if (strcmp(argv[i], "--periodic") == 0)
+	    physics.periodic = true;
+	else if (strcmp(argv[i], "--broadphase") == 0 && i + 1 < argc
+		 && parse_broadphase_kind(argv[i + 1], &physics.broadphase))
+	    ++i;
+	else if (strcmp(argv[i], "--offscreen") == 0 && i + 1 < argc)
+	    offscreen_pattern = argv[++i];
+	else if (strcmp(argv[i], "--steps") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+	    offscreen_steps = atoi(argv[++i]);
+	else if (strcmp(argv[i], "--frame-every") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+	    frame_interval = atoi(argv[++i]);
+	else if (strcmp(argv[i], "--profile") == 0 && i + 1 < argc)
+	    profile_prefix = argv[++i];
+	else if (strcmp(argv[i], "--heatmap") == 0)
+	    session->show_room_heatmap = true;
+	else if (strcmp(argv[i], "--room-size") == 0 && i + 1 < argc && atof(argv[i + 1]) > 0)
+	    fixed_room_size = atof(argv[++i]);
+	else if (strcmp(argv[i], "--batch") == 0 && i + 1 < argc)
+	    batch_file = argv[++i];
+	else if (strcmp(argv[i], "--threads") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0)
+	    batch_threads = atoi(argv[++i]);
+	else if (strcmp(argv[i], "--batch-csv") == 0 && i + 1 < argc)
+	    batch_csv_file = argv[++i];
+	else
+	{
+	    std::cout << "usage: " << argv[0] << " [--snapshot FILE] [--checkpoint FILE] [--record FILE]"
+		      << " [--deterministic] [--periodic] [--hash-log FILE] [--gl-errors off|debug|frame|call]"
+		      << " [--offscreen FRAMES.png|FRAMES.rgba [--steps N] [--frame-every N]]"
+		      << " [--profile PREFIX] [--heatmap] [--room-size SIZE] [--broadphase grid|sweep]"
+		      << " [--batch FILE [--threads N] [--batch-csv FILE]]\n";
+	    return -1;
+	}
+    }
+
+    if (profile_prefix)
+    {
+	enable_profiler(true);
+	set_profile_thread_name("simulation");
+    }
+
+    if (batch_file)
+    {
+	std::vector<BatchScenario> scenarios;
+	if (!parse_batch_file(batch_file, &scenarios))
+	    return -1;
+	std::vector<WorldSummary> summaries = run_batch(scenarios, batch_threads);
+	print_batch_summaries(std::cout, summaries);
+	if (batch_csv_file && !write_batch_csv(batch_csv_file, summaries))
+	    return -1;
+	if (profile_prefix)
+	{
+	    export_profile_csv((std::string(profile_prefix) + ".csv").c_str());
+	    export_profile_trace((std::string(profile_prefix) + ".json").c_str());
+	}
+	for (WorldSummary const &summary : summaries)
+	    if (!summary.ok)
+		return -1;
+	return 0;
+    }
+
+    glm::mat4 &view = session->view;
+    view = glm::mat4();
+    view[0] = glm::vec4(0.1, 0, 0, 0);
+    view[1] = glm::vec4(0, 0.1, 0, 0);
+    view[2] = glm::vec4(0, 0, 1, 0);
+    view[3] = glm::vec4(-2, -2, 0, 1);
+    
+    // init physics
+    init_physics(&physics);
+
+    // init logic
+    if (snapshot_file)
+    {
+	if (!load_snapshot(&physics, &logic, snapshot_file))
+	    return -1;
+    }
+    else
+	init_logic_world(&logic, &physics);
+    if (fixed_room_size)
+    {
+	physics.room_tuning.enabled = false;
+	set_room_size(&physics, fixed_room_size, fixed_room_size);
+    }
+
+    Checkpointer checkpointer;
+    float const checkpoint_interval = 10;
+    if (checkpoint_file)
+	start_checkpointer(&checkpointer, checkpoint_file, checkpoint_interval);
+
+    HashLog hash_log;
+    if (hash_log_file && !open_hash_log(&hash_log, hash_log_file))
+	return -1;
+
+    // the ring buffer of the recorder is big, keep it off the stack
+    std::unique_ptr<TrajectoryRecorder> recorder;
+    if (record_file)
+    {
+	recorder.reset(new TrajectoryRecorder());
+	if (!start_recorder(recorder.get(), record_file))
+	    return -1;
+    }
+
+    auto simulate = [&](float elapsed_time)
+    {
+	PROFILE_SCOPE("simulation step");
+	update_logic(&logic, &physics, elapsed_time);
+	update_physics(&physics, elapsed_time);
+	if (checkpoint_file)
+	{
+	    PROFILE_SCOPE("checkpoint");
+	    update_checkpointer(&checkpointer, &physics, &logic, elapsed_time);
+	}
+	if (recorder)
+	{
+	    PROFILE_SCOPE("record");
+	    record_frame(recorder.get(), &physics, &logic);
+	}
+	if (hash_log_file)
+	{
+	    PROFILE_SCOPE("state hash");
+	    log_state_hash(&hash_log, &physics, &logic);
+	}
+    };
+
+    int result;
+    if (offscreen_pattern)
+	result = run_offscreen(session.get(), offscreen_pattern, offscreen_steps, frame_interval,
+			       gl_error_check, simulate);
+    else
+	result = run_window(session.get(), gl_error_check, simulate);
+
+    if (checkpoint_file)
+	stop_checkpointer(&checkpointer);
+    if (recorder && !stop_recorder(recorder.get()))
+	result = -1;
+    close_hash_log(&hash_log);
+    if (profile_prefix)
+    {
+	print_profile_stats(std::cout);
+	export_profile_csv((std::string(profile_prefix) + ".csv").c_str());
+	export_profile_trace((std::string(profile_prefix) + ".json").c_str());
+    }
+    return result;
 }
@@ -2,7 +2,11 @@
 #include <glm/glm.hpp>
 #include <cmath>
 #include "physics.hpp"
+#include "profiler/profiler.hpp"
+#include "util/det_math.hpp"
 #include <algorithm>
+#include <cstring>
+#include <ostream>
 #include <vector>
 #include "Iterator.hpp"
 
@@ -12,11 +16,12 @@
 /// for repulsion, all distances below the prefered result in correction force.
 /// for repulsion, all distances above the prefered result in correction force.
 /// correction force for a distance of exactly one is "base_force"
-void apply_spring_force(Body *body0, Body *body1, 
+/// "sub" is the vector from body0 to body1 (-> body_separation)
+/// Returns whether there was any force.
+bool apply_spring_force(Body *body0, Body *body1, glm::vec2 sub,
         float distance, float base_force, int repulsion, 
         float time)
 {   
-    glm::vec2 sub = body1->pos - body0->pos;
     float dist = glm::length(sub);
     float stretch_factor = 
         dist - body0->radius() - body1->radius() - distance;
@@ -41,6 +46,7 @@ void apply_spring_force(Body *body0, Body *body1,
 	force_vec = glm::vec2(1.f, 0.f) * force;
     body0->vel+= force_vec * (time / body0->mass);
     body1->vel-= force_vec * (time / body1->mass);
+    return force != 0;
 }
 
 /// applies torque on both bodies to achieve the target delta angle
@@ -54,6 +60,22 @@ void apply_angle_force(Body *body0, Body *body1,
     body1->angle_vel-= correction * time / body1->mass;
 }
 
+glm::vec2 nearest_image(PhysicsWorld const *world, glm::vec2 sub)
+{
+    if (world->periodic)
+    {
+	sub.x-= world->width * floorf(sub.x / world->width + 0.5f);
+	sub.y-= world->height * floorf(sub.y / world->height + 0.5f);
+    }
+    return sub;
+}
+
+/// The vector from body0 to body1, in periodic worlds to the nearest image of body1
+glm::vec2 body_separation(PhysicsWorld const *world, Body const *body0, Body const *body1)
+{
+    return nearest_image(world, body1->pos - body0->pos);
+}
+
 void apply_attachment_forces(PhysicsWorld *world, float time, float base_force)
 {    
     world->attachments.iter().do_each(
@@ -62,7 +84,7 @@ void apply_attachment_forces(PhysicsWorld *world, float time, float base_force)
 	    Body *body0 = &*attachment->bodies[0];
 	    Body *body1 = &*attachment->bodies[1];
  	    apply_spring_force(
-                body0, body1, 
+                body0, body1, body_separation(world, body0, body1),
                 attachment->config.distance, 
                 base_force * attachment->config.strength, 
                 0, time);
@@ -77,21 +99,59 @@ void apply_attachment_forces(PhysicsWorld *world, float time, float base_force)
 
 void apply_damping(PhysicsWorld *world, float decay_per_second, float time)
 {
+    // computed once, so every body is damped by exactly the same factor
+    float damping = det_pow(decay_per_second, time);
     world->bodies.iter().do_each([&](Body *body)
         {
-	    body->vel*= pow(decay_per_second, time);
-	    body->angle_vel*= pow(decay_per_second, time);		    
+	    body->vel*= damping;
+	    body->angle_vel*= damping;
         });
 }
 
-void calc_body_room(PhysicsWorld *world, Body *body, int *room_x, int *room_y)
+void RoomLevel::room_of(glm::vec2 pos, int *x, int *y) const
+{
+    *x = floorf(pos[0] / room_width);
+    *y = floorf(pos[1] / room_height);
+    if (*x < 0) *x = 0;
+    if (*x >= rooms_x) *x = rooms_x - 1;
+    if (*y < 0) *y = 0;
+    if (*y >= rooms_y) *y = rooms_y - 1;
+}
+
+void calc_body_room(PhysicsWorld *world, Body *body, int *room_level, int *room_x, int *room_y)
+{
+    std::vector<RoomLevel> const &levels = world->body_rooms.levels;
+    float diameter = 2 * body->radius();
+    int level = 0;
+    while (level + 1 < (int)levels.size()
+	   && (levels[level].room_width < diameter || levels[level].room_height < diameter))
+	++level;
+    *room_level = level;
+    levels[level].room_of(body->pos, room_x, room_y);
+}
+
+/// Take the body out of the room it is stored in
+void leave_room(BodyRooms *rooms, Body *body)
 {
-    *room_x = floorf(body->pos[0] / world->body_rooms.room_width);
-    *room_y = floorf(body->pos[1] / world->body_rooms.room_height);
-    if (*room_x < 0) *room_x = 0;
-    if (*room_x >= ROOMS_X) *room_x = ROOMS_X - 1;
-    if (*room_y < 0) *room_y = 0;
-    if (*room_y >= ROOMS_Y) *room_y = ROOMS_Y - 1;
+    RoomLevel &level = rooms->levels[body->room_level];
+    int r = body->room_x * level.rooms_y + body->room_y;
+    std::vector<Body *> &room = level.rooms[r];
+    std::vector<Body *>::iterator i = std::find(room.begin(), room.end(), body);
+    if (i != room.end())
+    {
+	std::swap(*i, room.back());
+	room.pop_back();
+	level.body_count--;
+	if (room.empty())
+	{
+	    // into the place of the room in the occupied rooms, the last one
+	    int index = level.occupied_index[r];
+	    level.occupied[index] = level.occupied.back();
+	    level.occupied_index[level.occupied[index]] = index;
+	    level.occupied.pop_back();
+	    level.occupied_index[r] = -1;
+	}
+    }
 }
 
 /// The given pointer to the body will be added to the BodyRooms.
@@ -101,98 +161,505 @@ void update_body_room(PhysicsWorld *world, Body *body)
 {
     BodyRooms *rooms = &world->body_rooms;
     
-    int room_x, room_y;
-    calc_body_room(world, body, &room_x, &room_y);
+    int room_level, room_x, room_y;
+    calc_body_room(world, body, &room_level, &room_x, &room_y);
 
-    if (room_x != body->room_x || room_y != body->room_y)
+    if (room_level != body->room_level || room_x != body->room_x || room_y != body->room_y)
     {
-	std::vector<Body *> &old_room = rooms->rooms[body->room_x][body->room_y];
-	std::vector<Body *>::iterator i = std::find(old_room.begin(), old_room.end(), body);
-        if (i != old_room.end())
+	// negative coords: the body is not in any room yet
+	if (body->room_level >= 0 && body->room_x >= 0 && body->room_y >= 0)
+	    leave_room(rooms, body);
+
+	RoomLevel &level = rooms->levels[room_level];
+	int r = room_x * level.rooms_y + room_y;
+	if (level.rooms[r].empty())
 	{
-	    std::swap(*i, old_room.back());
-	    old_room.pop_back();
+	    level.occupied_index[r] = level.occupied.size();
+	    level.occupied.push_back(r);
 	}
+	level.rooms[r].push_back(body);
+	level.body_count++;
 
-        rooms->rooms[room_x][room_y].push_back(body);
-
+	body->room_level = room_level;
         body->room_x = room_x;
         body->room_y = room_y;
     }
 }
 
+/// Order the occupied rooms and the bodies of every room by slot, which fixes
+/// the order in which the repulsion forces are summed up
+void sort_body_rooms(PhysicsWorld *world)
+{
+    for (RoomLevel &level : world->body_rooms.levels)
+    {
+	std::sort(level.occupied.begin(), level.occupied.end());
+	for (size_t i = 0; i != level.occupied.size(); ++i)
+	{
+	    level.occupied_index[level.occupied[i]] = i;
+	    std::vector<Body *> &room = level.rooms[level.occupied[i]];
+	    std::sort(room.begin(), room.end());
+	}
+    }
+}
+
+/// Put every body into the room it is in, bodies with negative room coords
+/// are not in any room yet.
 void update_all_body_rooms(PhysicsWorld *world)
 {
     world->bodies.iter().do_each([&](Body *body) {update_body_room(world, &*body);});
 }
 
-/// i=0: small x
-/// 1: big x
-/// 2: small y
-/// 3: big y
-float room_edge(float width, float height, int dir)
+/// Fit the bounds of every occupied room to its bodies, the bounds of the
+/// empty rooms stay empty
+void update_room_bounds(BodyRooms *rooms)
 {
-    return (dir % 2) * (width * (1 - dir/2) + height * (dir / 2));
+    for (RoomLevel &level : rooms->levels)
+    {
+	for (int r : level.occupied)
+	{
+	    RoomBounds &bounds = level.bounds[r];
+	    bounds = RoomBounds();
+	    for (Body const *body : level.rooms[r])
+	    {
+		bounds.min = glm::min(bounds.min, body->pos);
+		bounds.max = glm::max(bounds.max, body->pos);
+		bounds.max_radius = std::max(bounds.max_radius, body->radius());
+	    }
+	}
+    }
 }
 
-/// given: two room coordinates and a direction
-/// outputs: the neighbor of that room
-/// meaning of dir: ->room_edge
-void neighbor_room(int *room_x, int *room_y, int dir)
+/// Squared distance between two boxes, 0 if they overlap
+float box_distance_sq(glm::vec2 min0, glm::vec2 max0, glm::vec2 min1, glm::vec2 max1)
 {
-    *room_x+= (1 - dir/2) * (dir * 2 - 1);
-    *room_y+= (dir/2) * ((dir - 2) * 2 - 1);
+    glm::vec2 gap = glm::max(glm::max(min0 - max1, min1 - max0), glm::vec2(0, 0));
+    return glm::dot(gap, gap);
 }
 
-void apply_repulsion_forces(PhysicsWorld *world, float base_force, float time)
+/// The candidate pairs of the BodyRooms, each once.
+/// The pairs within a level are found in the body's room and the half of
+/// the 3x3 rooms around it that comes after it, the pairs across levels
+/// from the finer room, in the rooms of every coarser level around it.
+/// Pairs of rooms are ruled out by their bounds, then the bodies of the finer
+/// room one by one.
+/// In periodic worlds, the neighbor rooms wrap around, their bodies are moved
+/// by an offset next to the room they were looked up from. The levels have
+/// at least 3 rooms per axis there, so the wrapped neighbors are distinct rooms.
+template <typename F>
+void grid_candidate_pairs(PhysicsWorld *world, F f)
 {
-    BodyRooms *rooms = &world->body_rooms;
-    for (int i = 0; i < ROOMS_X; ++i)
-    for (int j = 0; j < ROOMS_Y; ++j)
+    std::vector<RoomLevel> &levels = world->body_rooms.levels;
+    update_room_bounds(&world->body_rooms);
+    size_t neighbor_room_visits = 0, rejected_rooms = 0;
+    auto visit_rooms = [&](std::vector<Body *> &bodies, RoomBounds const &bounds,
+			   std::vector<Body *> &others, RoomBounds const &others_bounds,
+			   glm::vec2 offset)
+    {
+	if (others.empty())
+	    return;
+	neighbor_room_visits++;
+	glm::vec2 others_min = others_bounds.min + offset, others_max = others_bounds.max + offset;
+	float reach = bounds.max_radius + others_bounds.max_radius;
+	if (box_distance_sq(bounds.min, bounds.max, others_min, others_max) >= reach * reach)
+	{
+	    rejected_rooms++;
+	    return;
+	}
+	for (Body *body : bodies)
+	{
+	    reach = body->radius() + others_bounds.max_radius;
+	    if (box_distance_sq(body->pos, body->pos, others_min, others_max) >= reach * reach)
+		continue;
+	    for (Body *other : others)
+		f(body, other, other->pos + offset - body->pos);
+	}
+    };
+    // false for rooms outside of the grid, periodic worlds wrap them around
+    auto find_room = [&](RoomLevel const &level, int *x, int *y, glm::vec2 *offset)
+    {
+	*offset = glm::vec2(0, 0);
+	if (world->periodic)
+	{
+	    if (*x < 0 || *x >= level.rooms_x)
+	    {
+		offset->x = *x < 0 ? -world->width : world->width;
+		*x+= *x < 0 ? level.rooms_x : -level.rooms_x;
+	    }
+	    if (*y < 0 || *y >= level.rooms_y)
+	    {
+		offset->y = *y < 0 ? -world->height : world->height;
+		*y+= *y < 0 ? level.rooms_y : -level.rooms_y;
+	    }
+	}
+	return *x >= 0 && *x < level.rooms_x && *y >= 0 && *y < level.rooms_y;
+    };
+
+    int const ahead[4][2] = {{1, -1}, {1, 0}, {1, 1}, {0, 1}};
+    for (size_t l = 0; l != levels.size(); ++l)
+    {
+	RoomLevel &level = levels[l];
+	for (int r : level.occupied)
+	{
+	    int i = r / level.rooms_y, j = r % level.rooms_y;
+	    std::vector<Body *> &bodies = level.rooms[r];
+	    RoomBounds const &bounds = level.room_bounds(i, j);
+	    for (size_t a = 0; a < bodies.size(); ++a)
+		for (size_t b = a + 1; b < bodies.size(); ++b)
+		    f(bodies[a], bodies[b], bodies[b]->pos - bodies[a]->pos);
+
+	    glm::vec2 offset;
+	    for (int n = 0; n != 4; ++n)
+	    {
+		int x = i + ahead[n][0], y = j + ahead[n][1];
+		if (find_room(level, &x, &y, &offset))
+		    visit_rooms(bodies, bounds, level.room(x, y), level.room_bounds(x, y), offset);
+	    }
+
+	    // the coarser rooms around the bodies, which span at most two of them per axis
+	    for (size_t c = l + 1; c != levels.size(); ++c)
+	    {
+		RoomLevel &coarse = levels[c];
+		if (!coarse.body_count)
+		    continue;
+		int min_x, min_y, max_x, max_y;
+		coarse.room_of(bounds.min, &min_x, &min_y);
+		coarse.room_of(bounds.max, &max_x, &max_y);
+		if (world->periodic)
+		{
+		    // wrapped around, no room twice
+		    max_x = std::min(max_x, min_x + coarse.rooms_x - 3);
+		    max_y = std::min(max_y, min_y + coarse.rooms_y - 3);
+		}
+		for (int x = min_x - 1; x <= max_x + 1; ++x)
+		for (int y = min_y - 1; y <= max_y + 1; ++y)
+		{
+		    int room_x = x, room_y = y;
+		    if (find_room(coarse, &room_x, &room_y, &offset))
+			visit_rooms(bodies, bounds, coarse.room(room_x, room_y),
+				    coarse.room_bounds(room_x, room_y), offset);
+		}
+	    }
+	}
+    }
+    world->telemetry.neighbor_room_visits = neighbor_room_visits;
+    world->telemetry.rejected_rooms = rejected_rooms;
+}
+
+/// Whether entry a goes before entry b. Ties are broken by the address of the body,
+/// so that the order only depends on the bodies, not on the history of the sort.
+bool sweep_entry_before(SweepAndPrune::Entry const &a, SweepAndPrune::Entry const &b)
+{
+    return a.min_x < b.min_x || (a.min_x == b.min_x && a.body < b.body);
+}
+
+void set_sweep_extent(SweepAndPrune::Entry *entry)
+{
+    Body const *body = entry->body;
+    entry->radius = body->radius();
+    entry->min_x = body->pos.x - entry->radius;
+    entry->max_x = body->pos.x + entry->radius;
+    entry->y = body->pos.y;
+}
+
+/// Move the entry at i to its place in the order, returns the moves
+size_t sift_sweep_entry(SweepAndPrune *sweep, size_t i)
+{
+    std::vector<SweepAndPrune::Entry> &entries = sweep->entries;
+    SweepAndPrune::Entry entry = entries[i];
+    size_t j = i;
+    for (; j > 0 && sweep_entry_before(entry, entries[j - 1]); --j)
+    {
+	entries[j] = entries[j - 1];
+	entries[j].body->sweep_index = j;
+    }
+    if (j == i)
+	for (; j + 1 < entries.size() && sweep_entry_before(entries[j + 1], entry); ++j)
+	{
+	    entries[j] = entries[j + 1];
+	    entries[j].body->sweep_index = j;
+	}
+    entries[j] = entry;
+    entry.body->sweep_index = j;
+    return i > j ? i - j : j - i;
+}
+
+void sweep_insert(SweepAndPrune *sweep, Body *body)
+{
+    if (body->sweep_index < 0)
+    {
+	SweepAndPrune::Entry entry;
+	entry.body = body;
+	body->sweep_index = sweep->entries.size();
+	sweep->entries.push_back(entry);
+    }
+    SweepAndPrune::Entry &entry = sweep->entries[body->sweep_index];
+    set_sweep_extent(&entry);
+    sweep->max_radius = std::max(sweep->max_radius, entry.radius);
+    sift_sweep_entry(sweep, body->sweep_index);
+}
+
+void sweep_remove(SweepAndPrune *sweep, Body *body)
+{
+    if (body->sweep_index < 0 || body->sweep_index >= (int)sweep->entries.size()
+	|| sweep->entries[body->sweep_index].body != body)
+	return;
+    std::vector<SweepAndPrune::Entry> &entries = sweep->entries;
+    entries.erase(entries.begin() + body->sweep_index);
+    for (size_t i = body->sweep_index; i != entries.size(); ++i)
+	entries[i].body->sweep_index = i;
+    body->sweep_index = -1;
+}
+
+/// Refresh the extents of the bodies and restore the order, returns the moves of the sort
+size_t sort_sweep_entries(SweepAndPrune *sweep)
+{
+    std::vector<SweepAndPrune::Entry> &entries = sweep->entries;
+    sweep->max_radius = 0;
+    for (SweepAndPrune::Entry &entry : entries)
+    {
+	set_sweep_extent(&entry);
+	sweep->max_radius = std::max(sweep->max_radius, entry.radius);
+    }
+    size_t moves = 0;
+    for (size_t i = 1; i < entries.size(); ++i)
+	if (sweep_entry_before(entries[i], entries[i - 1]))
+	    moves+= sift_sweep_entry(sweep, i);
+    return moves;
+}
+
+/// The candidate pairs of the SweepAndPrune, each once: the pairs whose extents
+/// overlap along x, and across y no farther apart than their radii.
+/// The extents are refreshed first, the bodies may have changed since the update.
+/// In periodic worlds, the entries at the front are also swept moved by the width
+/// of the world, for the bodies reaching over its right bound.
+template <typename F>
+void sweep_candidate_pairs(PhysicsWorld *world, F f)
+{
+    SweepAndPrune *sweep = &world->sweep_and_prune;
+    world->telemetry.sort_moves+= sort_sweep_entries(sweep);
+    std::vector<SweepAndPrune::Entry> const &entries = sweep->entries;
+    size_t count = entries.size();
+    float width = world->width, height = world->height;
+    auto visit = [&](SweepAndPrune::Entry const &entry, SweepAndPrune::Entry const &other,
+		     float offset_x)
+    {
+	float dy = other.y - entry.y;
+	if (world->periodic)
+	    dy-= height * floorf(dy / height + 0.5f);
+	if (fabsf(dy) < entry.radius + other.radius)
+	    f(entry.body, other.body, glm::vec2(other.body->pos.x + offset_x - entry.body->pos.x, dy));
+    };
+    for (size_t i = 0; i != count; ++i)
+    {
+	SweepAndPrune::Entry const &entry = entries[i];
+	for (size_t j = i + 1; j != count && entries[j].min_x < entry.max_x; ++j)
+	    visit(entry, entries[j], 0);
+	if (!world->periodic)
+	    continue;
+	for (size_t j = 0; j != count && entries[j].min_x + width < entry.max_x; ++j)
+	    if (j != i)
+		visit(entry, entries[j], width);
+    }
+}
+
+template <typename F>
+void visit_candidate_pairs(PhysicsWorld *world, F f)
+{
+    switch (world->broadphase)
+    {
+    case BROADPHASE_GRID:
+	grid_candidate_pairs(world, f);
+	break;
+    case BROADPHASE_SWEEP_AND_PRUNE:
+	sweep_candidate_pairs(world, f);
+	break;
+    }
+}
+
+void for_each_candidate_pair(PhysicsWorld *world,
+			     std::function<void(Body *, Body *, glm::vec2)> const &f)
+{
+    visit_candidate_pairs(world, f);
+}
+
+void broadphase_insert(PhysicsWorld *world, Body *body)
+{
+    switch (world->broadphase)
     {
-	std::vector<Body *> &bodies = rooms->rooms[i][j];
-        for (std::vector<Body *>::iterator body = bodies.begin(); body != bodies.end(); ++body)
+    case BROADPHASE_GRID:
+	update_body_room(world, body);
+	break;
+    case BROADPHASE_SWEEP_AND_PRUNE:
+	sweep_insert(&world->sweep_and_prune, body);
+	break;
+    }
+}
+
+void update_broadphase(PhysicsWorld *world)
+{
+    switch (world->broadphase)
+    {
+    case BROADPHASE_GRID:
+	update_all_body_rooms(world);
+	break;
+    case BROADPHASE_SWEEP_AND_PRUNE:
+	world->bodies.iter().do_each([&](Body *body)
+	    {
+		if (body->sweep_index < 0)
+		    sweep_insert(&world->sweep_and_prune, body);
+	    });
+	world->telemetry.sort_moves+= sort_sweep_entries(&world->sweep_and_prune);
+	break;
+    }
+}
+
+void broadphase_remove(PhysicsWorld *world, Body *body)
+{
+    // the broadphase may have been rebuilt without the body since it was
+    // removed (-> publish_bodies), then its room or index is stale
+    switch (world->broadphase)
+    {
+    case BROADPHASE_GRID:
+	if (body->room_level >= 0 && body->room_x >= 0 && body->room_y >= 0
+	    && body->room_level < (int)world->body_rooms.levels.size()
+	    && body->room_x < world->body_rooms.levels[body->room_level].rooms_x
+	    && body->room_y < world->body_rooms.levels[body->room_level].rooms_y)
+	    leave_room(&world->body_rooms, body);
+	break;
+    case BROADPHASE_SWEEP_AND_PRUNE:
+	sweep_remove(&world->sweep_and_prune, body);
+	break;
+    }
+}
+
+void remove_body(PhysicsWorld *world, ConcurrentSlot<Body> *slot)
+{
+    world->bodies.remove(slot);
+}
+
+void publish_bodies(PhysicsWorld *world)
+{
+    world->bodies.publish([&](Body *body) {broadphase_remove(world, body);});
+}
+
+void set_broadphase(PhysicsWorld *world, BroadphaseKind kind)
+{
+    if (kind == world->broadphase)
+	return;
+    for (RoomLevel &level : world->body_rooms.levels)
+    {
+	for (int r : level.occupied)
+	{
+	    level.rooms[r].clear();
+	    level.occupied_index[r] = -1;
+	}
+	level.occupied.clear();
+	level.body_count = 0;
+    }
+    world->sweep_and_prune.entries.clear();
+    world->bodies.iter().do_each([&](Body *body)
         {
-            // Apply on all bodies in the same room
-            for (std::vector<Body *>::iterator other = bodies.begin(); other != bodies.end(); ++other)
-            {
-                if (other == body)
-                    continue;
-                apply_spring_force(
-                        *body, *other,
-                        0, base_force, 1, time); 
-            }
-
-            // apply on bodies in neighboring rooms IF this body touches other rooms
-            // dir=0: small x
-            // 1: big x
-            // 2: small y
-            // 3: big y
-            for (int dir = 0; dir < 4; ++dir)
-            {
-                float coord = (*body)->pos[dir / 2];
-                float abs_room_edge = coord + 
-                    room_edge(rooms->room_width, rooms->room_height, dir);
-                if (fabsf(coord - abs_room_edge) < (*body)->radius())
-                {
-                    int other_room_x = i;
-                    int other_room_y = j;
-                    neighbor_room(&other_room_x, &other_room_y, dir);
-
-                    if (other_room_x >= 0 && other_room_x < ROOMS_X && other_room_y >= 0 && other_room_y < ROOMS_Y)
-                    {
-			std::vector<Body *> &bodies_other_room =
-                            rooms->rooms[other_room_x][other_room_y];
-                        for (std::vector<Body *>::iterator other = bodies_other_room.begin(); other != bodies_other_room.end(); ++other)
-                            apply_spring_force(
-                                *body, *other,
-                                0, base_force, 1, time);
-                    }
-                    
-                }
-            }
-        }
+	    body->room_level = body->room_x = body->room_y = -1;
+	    body->sweep_index = -1;
+	});
+    world->broadphase = kind;
+    update_broadphase(world);
+}
+
+bool parse_broadphase_kind(const char *name, BroadphaseKind *kind)
+{
+    for (BroadphaseKind k : {BROADPHASE_GRID, BROADPHASE_SWEEP_AND_PRUNE})
+	if (strcmp(name, broadphase_name(k)) == 0)
+	{
+	    *kind = k;
+	    return true;
+	}
+    return false;
+}
+
+const char *broadphase_name(BroadphaseKind kind)
+{
+    switch (kind)
+    {
+    case BROADPHASE_GRID:
+	return "grid";
+    case BROADPHASE_SWEEP_AND_PRUNE:
+	return "sweep";
     }
+    return "unknown";
+}
+
+/// Repulse every pair of overlapping bodies once. The candidate pairs
+/// of the broadphase are ruled out by their squared distance, so only the
+/// pairs that repulse get to the square root of the spring force.
+void apply_repulsion_forces(PhysicsWorld *world, float base_force, float time)
+{
+    // the force a pair used to get from being found by both of its bodies
+    float pair_force = 2 * base_force;
+    size_t candidate_pairs = 0, force_pairs = 0;
+    visit_candidate_pairs(world, [&](Body *body, Body *other, glm::vec2 sub)
+	{
+	    float reach = body->radius() + other->radius();
+	    candidate_pairs++;
+	    if (glm::dot(sub, sub) < reach * reach)
+		force_pairs+= apply_spring_force(body, other, sub, 0, pair_force, 1, time);
+	});
+    world->telemetry.candidate_pairs = candidate_pairs;
+    world->telemetry.force_pairs = force_pairs;
+}
+
+/// The occupancy part of the RoomTelemetry
+void update_room_telemetry(PhysicsWorld *world)
+{
+    RoomTelemetry &telemetry = world->telemetry;
+    std::vector<RoomLevel> const &levels = world->body_rooms.levels;
+    telemetry.occupied_rooms = telemetry.max_occupancy = telemetry.max_border_occupancy = 0;
+    std::fill(telemetry.occupancy_histogram, telemetry.occupancy_histogram + RoomTelemetry::BUCKETS, 0);
+    std::fill(telemetry.level_bodies, telemetry.level_bodies + MAX_ROOM_LEVELS, 0);
+    for (size_t l = 0; l != levels.size(); ++l)
+    {
+	RoomLevel const &level = levels[l];
+	telemetry.level_bodies[l] = level.body_count;
+	telemetry.occupancy_histogram[0]+= level.rooms.size() - level.occupied.size();
+	telemetry.occupied_rooms+= level.occupied.size();
+	for (int r : level.occupied)
+	{
+	    int i = r / level.rooms_y, j = r % level.rooms_y;
+	    size_t occupancy = level.rooms[r].size();
+	    int bucket = 0;
+	    for (size_t n = occupancy; n != 0 && bucket + 1 < RoomTelemetry::BUCKETS; n/= 2)
+		++bucket;
+	    telemetry.occupancy_histogram[bucket]++;
+	    telemetry.max_occupancy = std::max(telemetry.max_occupancy, occupancy);
+	    if (i == 0 || j == 0 || i == level.rooms_x - 1 || j == level.rooms_y - 1)
+		telemetry.max_border_occupancy = std::max(telemetry.max_border_occupancy, occupancy);
+	}
+    }
+}
+
+void print_room_telemetry(std::ostream &out, RoomTelemetry const &telemetry)
+{
+    out << "rooms: " << telemetry.occupied_rooms << " occupied, max " << telemetry.max_occupancy
+	<< " bodies, max at the bounds " << telemetry.max_border_occupancy
+	<< "; pairs: " << telemetry.candidate_pairs << " tested, " << telemetry.force_pairs
+	<< " repulsed; neighbor rooms: " << telemetry.neighbor_room_visits << " visited, "
+	<< telemetry.rejected_rooms << " ruled out by their bounds; sort moves: "
+	<< telemetry.sort_moves << "\n";
+    out << "bodies per room:";
+    for (int i = 0; i != RoomTelemetry::BUCKETS; ++i)
+    {
+	if (i < 2)
+	    out << " " << i;
+	else if (i + 1 < RoomTelemetry::BUCKETS)
+	    out << " " << (1 << (i - 1)) << "-" << (1 << i) - 1;
+	else
+	    out << " " << (1 << (i - 1)) << "+";
+	out << ":" << telemetry.occupancy_histogram[i];
+    }
+    out << "\nbodies per level, finest first:";
+    for (int l = 0; l != MAX_ROOM_LEVELS; ++l)
+	out << " " << telemetry.level_bodies[l];
+    out << "\n";
 }
 
 void ensure_inside_bounds(float left, float bottom, float right, float top, Body *body)
@@ -207,24 +674,129 @@ void ensure_inside_bounds(float left, float bottom, float right, float top, Body
         body->pos[1] = top;
 }
 
-void apply_velocities(PhysicsWorld *world, float time)
+/// Move the body into the world, coming in on the other side
+void wrap_around_bounds(float width, float height, Body *body)
 {
-    auto room_width = world->body_rooms.room_width;
-    auto room_height = world->body_rooms.room_height;
+    body->pos[0]-= width * floorf(body->pos[0] / width);
+    body->pos[1]-= height * floorf(body->pos[1] / height);
+}
 
+void apply_velocities(PhysicsWorld *world, float time)
+{
     world->bodies.iter().do_each([&](Body *body)
         {
 	    if (!body->fixed)
 	    {
 		body->pos+= body->vel * time;
 		body->angle+= body->angle_vel * time;
-		ensure_inside_bounds(0, 0, room_width * ROOMS_X, room_height * ROOMS_Y, &*body);             }
+		if (world->periodic)
+		    wrap_around_bounds(world->width, world->height, &*body);
+		else
+		    ensure_inside_bounds(0, 0, world->width, world->height, &*body);
+	    }
 	});
 }
 
+/// The width of the finest rooms set_room_size() makes of the given one
+float finest_room_width(PhysicsWorld const *world, float room_width)
+{
+    float width = std::max(room_width, world->width / MAX_ROOMS_PER_AXIS);
+    if (world->periodic)
+	return world->width / std::max((int)(world->width / width), 3);
+    return width;
+}
+
+void set_room_size(PhysicsWorld *world, float room_width, float room_height)
+{
+    BodyRooms *rooms = &world->body_rooms;
+    rooms->levels.clear();
+    float width = std::max(room_width, world->width / MAX_ROOMS_PER_AXIS);
+    float height = std::max(room_height, world->height / MAX_ROOMS_PER_AXIS);
+    while ((int)rooms->levels.size() < MAX_ROOM_LEVELS)
+    {
+	RoomLevel level;
+	if (world->periodic)
+	{
+	    // the rooms tile the world, at least 3 per axis
+	    level.rooms_x = std::max((int)(world->width / width), 3);
+	    level.rooms_y = std::max((int)(world->height / height), 3);
+	    level.room_width = world->width / level.rooms_x;
+	    level.room_height = world->height / level.rooms_y;
+	}
+	else
+	{
+	    level.rooms_x = std::max((int)ceilf(world->width / width), 1);
+	    level.rooms_y = std::max((int)ceilf(world->height / height), 1);
+	    level.room_width = width;
+	    level.room_height = height;
+	}
+	level.rooms.assign(level.rooms_x * level.rooms_y, std::vector<Body *>());
+	level.bounds.assign(level.rooms.size(), RoomBounds());
+	level.occupied_index.assign(level.rooms.size(), -1);
+	rooms->levels.push_back(level);
+	int min_rooms = world->periodic ? 3 : 1;
+	if (level.rooms_x == min_rooms && level.rooms_y == min_rooms)
+	    break;
+	width*= 2;
+	height*= 2;
+    }
+    rooms->room_width = rooms->levels[0].room_width;
+    rooms->room_height = rooms->levels[0].room_height;
+    if (world->broadphase != BROADPHASE_GRID)
+	return;
+    world->bodies.iter().do_each([&](Body *body)
+        {
+	    body->room_level = body->room_x = body->room_y = -1;
+	    update_body_room(world, body);
+	});
+}
+
+float optimal_room_size(PhysicsWorld *world)
+{
+    RoomTuning &tuning = world->room_tuning;
+    RoomLevel const &finest = world->body_rooms.levels[0];
+    std::vector<float> &radii = tuning.radii;
+    radii.clear();
+    world->bodies.iter().do_each([&](Body *body) {radii.push_back(body->radius());});
+    if (radii.empty())
+	return finest.room_width;
+
+    std::nth_element(radii.begin(), radii.begin() + radii.size() / 10, radii.end());
+    float min_size = 2 * radii[radii.size() / 10];
+    if (!finest.body_count)
+	return min_size;
+
+    // the bodies per area where there are bodies at all in the finest level,
+    // from which the size with the target occupancy follows
+    float occupied_area = finest.occupied.size() * finest.room_width * finest.room_height;
+    float density = finest.body_count / occupied_area;
+    float size = sqrtf(tuning.target_occupancy / density);
+    return std::max(size, min_size);
+}
+
+/// Rebuild the rooms if the optimal size moved away from the current one
+void tune_room_size(PhysicsWorld *world)
+{
+    RoomTuning &tuning = world->room_tuning;
+    if (!tuning.enabled || world->broadphase != BROADPHASE_GRID || tuning.countdown-- > 0)
+	return;
+    tuning.countdown = tuning.interval;
+
+    float size = optimal_room_size(world);
+    float current = world->body_rooms.room_width;
+    // compared as set_room_size() would clamp and round it, an optimum out of
+    // reach would rebuild the same grid again and again
+    if (fabsf(finest_room_width(world, size) - current) <= tuning.rebuild_threshold * current)
+	return;
+    set_room_size(world, size, size);
+    tuning.rebuilds++;
+    LOG_DEBUG("Room size ", current, " -> ", world->body_rooms.room_width, ", ",
+	      world->body_rooms.levels.size(), " levels");
+}
+
 void init_physics(PhysicsWorld *world)
 {
-    world->body_rooms.room_width = world->body_rooms.room_height = 5;
+    set_room_size(world, 5, 5);
 }
 
 void update_physics(PhysicsWorld *world, float elapsed_time)
@@ -233,12 +805,37 @@ void update_physics(PhysicsWorld *world, float elapsed_time)
     float base_attachment_force = 5 / 0.5;
     float decay_per_second = 0.3;
 
-    apply_repulsion_forces(world, base_repulsion_force, elapsed_time);
-    apply_attachment_forces(world, elapsed_time, base_attachment_force);
-    apply_velocities(world, elapsed_time);
-    apply_damping(world, decay_per_second, elapsed_time);
+    world->telemetry.sort_moves = 0;
+    // the order of the sweep and prune only depends on the bodies already
+    if (world->deterministic && world->broadphase == BROADPHASE_GRID)
+    {
+	PROFILE_SCOPE("physics sort rooms");
+	sort_body_rooms(world);
+    }
+    {
+	PROFILE_SCOPE("physics repulsion");
+	apply_repulsion_forces(world, base_repulsion_force, elapsed_time);
+    }
+    {
+	PROFILE_SCOPE("physics attachments");
+	apply_attachment_forces(world, elapsed_time, base_attachment_force);
+    }
+    {
+	PROFILE_SCOPE("physics integrate");
+	apply_velocities(world, elapsed_time);
+    }
+    {
+	PROFILE_SCOPE("physics damping");
+	apply_damping(world, decay_per_second, elapsed_time);
+    }
     
-    update_all_body_rooms(world);
+    {
+	PROFILE_SCOPE("physics broadphase");
+	update_broadphase(world);
+	tune_room_size(world);
+    }
+    if (world->telemetry.enabled)
+	update_room_telemetry(world);
 }
 
 Optional<Attachment *> find_attachment(PhysicsWorld &world, Body *a, Body *b)
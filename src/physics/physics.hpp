@@ -2,14 +2,20 @@
 #define PHYSICS_H_INCLUDED
 
 #include <glm/glm.hpp>
+#include <cmath>
+#include <functional>
+#include <iosfwd>
 #include <vector>
 #include "Optional.hpp"
 #include "Iterator.hpp"
 #include "slots.hpp"
+#include "util/concurrent_slots.hpp"
 
-#define ROOMS_X 20
-#define ROOMS_Y 20
 constexpr size_t MAX_BODIES = 500;
+/// Bounds of the finest grid of rooms, the room size is limited so it fits
+constexpr int MAX_ROOMS_PER_AXIS = 128;
+/// Enough for the coarsest level of MAX_ROOMS_PER_AXIS to have a single room
+constexpr int MAX_ROOM_LEVELS = 8;
 constexpr size_t MAX_ATTACHMENTS = MAX_BODIES;
 
 struct Body
@@ -19,8 +25,16 @@ struct Body
     float mass = 1;
     /// The "density" of the body.
     float mass_per_radius = 1;
-    int room_x = -1, room_y = 1;
+    /// the room of the body in BodyRooms, negative: in no room yet
+    int room_level = -1, room_x = -1, room_y = 1;
+    /// index of the body in the SweepAndPrune, negative: not in it yet
+    int sweep_index = -1;
     bool fixed = false;
+    /// Scratch for the renderer: index of the body in the body buffer of the frame
+    /// being captured, -1 outside of capture_render_snapshot()
+    int render_index = -1;
+    /// Owner of the body, not used by the physics (the logic stores its Cell here)
+    void *user_data = nullptr;
 
     float radius() const
     {
@@ -47,30 +61,200 @@ struct Attachment
     Body *bodies[2];
 };
 
+/// Extent of the bodies of a room: the box around their centers and their
+/// largest radius. Empty rooms have an empty box, which is apart from everything.
+struct RoomBounds
+{
+    glm::vec2 min = glm::vec2(INFINITY, INFINITY), max = glm::vec2(-INFINITY, -INFINITY);
+    float max_radius = 0;
+};
+
+/// One grid of BodyRooms, covering the world
+struct RoomLevel
+{
+    /// room (x, y) at x * rooms_y + y
+    std::vector<std::vector<Body *>> rooms;
+    /// of every room, updated by the repulsion
+    std::vector<RoomBounds> bounds;
+    /// the rooms with bodies (x * rooms_y + y), so that the passes over the rooms
+    /// skip the empty ones. In no particular order, in the deterministic mode sorted.
+    std::vector<int> occupied;
+    /// of every room, its position in occupied, -1 if it is empty
+    std::vector<int> occupied_index;
+    int rooms_x = 0, rooms_y = 0;
+    float room_width, room_height;
+    size_t body_count = 0;
+
+    std::vector<Body *> &room(int x, int y)
+    {
+	return rooms[x * rooms_y + y];
+    }
+    std::vector<Body *> const &room(int x, int y) const
+    {
+	return rooms[x * rooms_y + y];
+    }
+    RoomBounds const &room_bounds(int x, int y) const
+    {
+	return bounds[x * rooms_y + y];
+    }
+    /// The room the point is in, clamped to the grid
+    void room_of(glm::vec2 pos, int *x, int *y) const;
+};
+
 /// Space partitioning. Only references Bodies, does not own them.
+/// A hierarchy of grids, the rooms of every level are twice as wide as
+/// those of the level below. A body is in the finest level whose rooms are
+/// at least as wide as the body, so it can only touch the bodies in the
+/// 3x3 rooms around its own in its level and in the coarser levels.
+/// The room size of the finest level is chosen at runtime (-> set_room_size).
 struct BodyRooms
 {
     /// Guarantee to the user that every room has a positive coordinate
     /// This makes it possible for the user to use negative coords for
     /// placeholders for "missing coord"
     static constexpr bool no_negative_rooms = true;
-    std::vector<Body *> rooms[ROOMS_X][ROOMS_Y];
+    /// finest first, the last one has rooms as wide as the world
+    std::vector<RoomLevel> levels;
+    /// of the finest level
     float room_width, room_height;
 };
 
+/// Sweep and prune along x: the bodies ordered by the left end of their extent.
+/// Two bodies can only touch if their extents overlap, so the pairs of a body
+/// are found by walking on from it while the left ends are left of its right end.
+/// The order changes little from step to step, it is restored by an insertion
+/// sort, which is close to linear on an almost sorted sequence.
+struct SweepAndPrune
+{
+    struct Entry
+    {
+	/// pos.x -/+ radius
+	float min_x, max_x;
+	float y, radius;
+	Body *body;
+    };
+    std::vector<Entry> entries;
+    float max_radius = 0;
+};
+
+/// Finds the pairs of bodies that may touch, for the repulsion
+enum BroadphaseKind
+{
+    BROADPHASE_GRID,		///< BodyRooms
+    BROADPHASE_SWEEP_AND_PRUNE,	///< SweepAndPrune
+};
+
+/// "grid" or "sweep", false if the name is neither
+bool parse_broadphase_kind(const char *name, BroadphaseKind *kind);
+const char *broadphase_name(BroadphaseKind kind);
+
+/// Chooses the room size of the finest level from the radii of the bodies and
+/// the occupancy of the rooms. Bodies much smaller than the finest rooms crowd them,
+/// which makes the repulsion in them quadratically more expensive, bodies larger
+/// than them go to coarser levels. The room size giving target_occupancy bodies per
+/// occupied room of the finest level is picked, at least the 10th percentile of the
+/// diameters. There is no upper bound, bodies wider than the rooms go to coarser levels.
+struct RoomTuning
+{
+    bool enabled = true;
+    /// steps between two evaluations
+    int interval = 30;
+    int countdown = 0;
+    float target_occupancy = 4;
+    /// relative difference between the optimum and the room size that rebuilds the grid
+    float rebuild_threshold = 0.25;
+    size_t rebuilds = 0;
+    /// scratch
+    std::vector<float> radii;
+};
+
+/// Load of the BodyRooms in the last step, to tune the room size.
+/// The pair counts are always gathered, the occupancy only if enabled.
+struct RoomTelemetry
+{
+    bool enabled = false;
+    /// body pairs whose distance the repulsion tested, and those of them that repulsed
+    size_t candidate_pairs = 0, force_pairs = 0;
+    /// pairs of rooms whose bodies may touch, and those of them the bounds of the rooms ruled out
+    size_t neighbor_room_visits = 0, rejected_rooms = 0;
+    /// entries the insertion sort of the SweepAndPrune moved
+    size_t sort_moves = 0;
+    size_t occupied_rooms = 0, max_occupancy = 0;
+    /// most bodies in a room at the bounds of the world (-> ensure_inside_bounds)
+    size_t max_border_occupancy = 0;
+    /// bodies in each level of the BodyRooms
+    size_t level_bodies[MAX_ROOM_LEVELS] = {};
+    /// rooms by the number of bodies in them: 0, 1, 2-3, 4-7, ...,
+    /// the last bucket takes everything above
+    static constexpr int BUCKETS = 10;
+    size_t occupancy_histogram[BUCKETS] = {};
+};
+
+void print_room_telemetry(std::ostream &out, RoomTelemetry const &telemetry);
+
 Optional<Attachment *> find_attachment(struct PhysicsWorld &world, Body *a, Body *b);
 
 struct PhysicsWorld
 {
     /// Order matters. (elements are referenced)
-    Slots<Body, MAX_BODIES> bodies;
+    /// Added bodies are only iterated after publish_bodies() (-> update_logic)
+    ConcurrentSlots<Body, MAX_BODIES> bodies;
     /// Order matters. (elements are referenced)
     Slots<Attachment, MAX_ATTACHMENTS> attachments;
+    /// Bounds of the world, the bodies are kept inside
+    float width = 100, height = 100;
+    /// Periodic boundaries: the world wraps around (a torus) instead of
+    /// stopping the bodies at its bounds. Forces act between the nearest images
+    /// of the bodies. To be set before init_physics().
+    /// Contacts of bodies wider than a third of the world may be missed.
+    bool periodic = false;
+    /// The broadphase in use, only its structure holds the bodies
+    /// (-> set_broadphase)
+    BroadphaseKind broadphase = BROADPHASE_GRID;
     BodyRooms body_rooms;
+    SweepAndPrune sweep_and_prune;
+    RoomTuning room_tuning;
+    RoomTelemetry telemetry;
+    /// Deterministic mode: forces are accumulated in a fixed order (bodies
+    /// of a room in slot order), independent of the history of the rooms,
+    /// so that differently scheduled kernels can be checked against each other
+    /// (-> state_hash.hpp). The math functions are pinned in any mode (-> det_math.hpp).
+    bool deterministic = false;
 };
 
 void init_physics(PhysicsWorld *world);
+/// The vector sub, in periodic worlds to the nearest image of its end
+glm::vec2 nearest_image(PhysicsWorld const *world, glm::vec2 sub);
 void update_physics(PhysicsWorld *world, float elapsed_time);
-void calc_body_room(PhysicsWorld *world, Body *body, int *room_x, int *room_y);
+void calc_body_room(PhysicsWorld *world, Body *body, int *room_level, int *room_x, int *room_y);
+
+/// The broadphase interface, dispatched on PhysicsWorld::broadphase (queries -> query.hpp).
+/// Put the body into the broadphase, or move it to where it is now if it is in already
+void broadphase_insert(PhysicsWorld *world, Body *body);
+/// Move every body to where it is now, the bodies that are not in yet are inserted
+void update_broadphase(PhysicsWorld *world);
+void broadphase_remove(PhysicsWorld *world, Body *body);
+/// Call f(body, other, sub) once for every pair of bodies that may touch,
+/// sub is the vector from body to (the nearest image of) other.
+/// Some of the pairs are apart, the caller tests their distance.
+void for_each_candidate_pair(PhysicsWorld *world,
+			     std::function<void(Body *, Body *, glm::vec2)> const &f);
+/// Move the bodies into the other broadphase
+void set_broadphase(PhysicsWorld *world, BroadphaseKind kind);
+
+/// Rebuild the rooms with the given size of the finest level, clamped so it has
+/// at most MAX_ROOMS_PER_AXIS rooms per axis. The grids cover the world,
+/// their last rooms may reach over its bounds. In periodic worlds, the rooms
+/// are widened to tile the world exactly.
+void set_room_size(PhysicsWorld *world, float room_width, float room_height);
+/// The room size RoomTuning aims for
+float optimal_room_size(PhysicsWorld *world);
+/// Hide the body from the iterators. It stays in the broadphase, where the queries
+/// still find it, until publish_bodies() takes it out and frees its slot, so that
+/// bodies can be removed while other threads query.
+void remove_body(PhysicsWorld *world, ConcurrentSlot<Body> *slot);
+/// Make the bodies added since visible, take the removed ones out of the
+/// broadphase and free their slots. The sync point of the bodies, not thread safe.
+void publish_bodies(PhysicsWorld *world);
 
 #endif
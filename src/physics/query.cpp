@@ -0,0 +1,53 @@
+#include "query.hpp"
+
+size_t query_nearest(PhysicsWorld const *world, glm::vec2 point, size_t k, NearestBody *nearest)
+{
+    if (k == 0)
+	return 0;
+    // the distance from the point that takes in the whole world
+    float cover;
+    if (world->periodic)
+	cover = 0.5f * glm::length(glm::vec2(world->width, world->height));
+    else
+	cover = glm::length(glm::max(glm::abs(point), glm::abs(point - glm::vec2(world->width, world->height))));
+
+    // widen the search until it has k bodies: those with their centers in the
+    // circle are the nearest, bodies farther away are skipped
+    float radius = world->body_rooms.room_width;
+    for (;;)
+    {
+	size_t count = 0;
+	visit_bodies_near(world, point - glm::vec2(radius, radius), point + glm::vec2(radius, radius),
+			  [&](Body *body)
+	    {
+		float distance = glm::length(nearest_image(world, body->pos - point));
+		if (distance > radius || (count == k && distance >= nearest[k - 1].distance))
+		    return;
+		// insertion, dropping the farthest if full
+		size_t i = count < k ? count++ : k - 1;
+		for (; i > 0 && nearest[i - 1].distance > distance; --i)
+		    nearest[i] = nearest[i - 1];
+		nearest[i].body = body;
+		nearest[i].distance = distance;
+	    });
+	if (count == k || radius >= cover)
+	    return count;
+	radius*= 2;
+    }
+}
+
+Body *pick_body(PhysicsWorld const *world, glm::vec2 point)
+{
+    Body *picked = nullptr;
+    float picked_distance = INFINITY;
+    visit_bodies_near(world, point, point, [&](Body *body)
+	{
+	    float distance = glm::length(nearest_image(world, body->pos - point));
+	    if (distance <= body->radius() && distance < picked_distance)
+	    {
+		picked = body;
+		picked_distance = distance;
+	    }
+	});
+    return picked;
+}
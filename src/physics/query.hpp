@@ -0,0 +1,146 @@
+#ifndef QUERY_HPP_INCLUDED
+#define QUERY_HPP_INCLUDED
+
+#include "physics.hpp"
+#include <algorithm>
+
+/// Spatial queries on the broadphase: which bodies are near a point.
+///
+/// The queries see the bodies in the broadphase as of its last update
+/// (-> update_broadphase), bodies added since are missing, bodies removed since
+/// are still found until publish_bodies() (-> remove_body). They only read
+/// the world and need no scratch memory, so any number of threads can query
+/// at the same time, also while others add and remove bodies, e.g. while cells
+/// die in update_logic(). What changes the broadphase must not run meanwhile:
+/// the physics step, update_broadphase(), set_broadphase(), set_room_size()
+/// and publish_bodies(). The callbacks are called inline, the results of
+/// query_nearest() go to the buffer of the caller.
+/// In periodic worlds, the bodies are found at their image nearest to the query.
+
+/// The rooms of the span along one axis, widened by one room: clamped to the grid,
+/// in periodic worlds the whole axis if the span wraps around onto itself.
+/// False if no room is left.
+inline bool query_room_span(float min, float max, float room_size, int rooms, bool periodic,
+			    int *first, int *last)
+{
+    float first_room = floorf(min / room_size) - 1, last_room = floorf(max / room_size) + 1;
+    if (periodic && last_room - first_room + 1 >= rooms)
+    {
+	first_room = 0;
+	last_room = rooms - 1;
+    }
+    else if (!periodic)
+    {
+	first_room = std::max(first_room, 0.f);
+	last_room = std::min(last_room, rooms - 1.f);
+    }
+    *first = first_room;
+    *last = last_room;
+    return *first <= *last;
+}
+
+/// Call f with every body that may reach into the box, each once, and some more
+/// around it. The rooms of a periodic grid wrap around, the box may reach over
+/// the bounds of the world.
+template <typename F>
+void visit_bodies_near(PhysicsWorld const *world, glm::vec2 min, glm::vec2 max, F f)
+{
+    switch (world->broadphase)
+    {
+    case BROADPHASE_GRID:
+	// a body is in a room that is at least as wide as the body,
+	// so it reaches at most into the next room
+	for (RoomLevel const &level : world->body_rooms.levels)
+	{
+	    int min_x, min_y, max_x, max_y;
+	    if (!level.body_count
+		|| !query_room_span(min.x, max.x, level.room_width, level.rooms_x, world->periodic,
+				    &min_x, &max_x)
+		|| !query_room_span(min.y, max.y, level.room_height, level.rooms_y, world->periodic,
+				    &min_y, &max_y))
+		continue;
+	    for (int x = min_x; x <= max_x; ++x)
+	    for (int y = min_y; y <= max_y; ++y)
+	    {
+		// into the grid, for periodic worlds
+		int room_x = (x % level.rooms_x + level.rooms_x) % level.rooms_x;
+		int room_y = (y % level.rooms_y + level.rooms_y) % level.rooms_y;
+		for (Body *body : level.room(room_x, room_y))
+		    f(body);
+	    }
+	}
+	break;
+    case BROADPHASE_SWEEP_AND_PRUNE:
+    {
+	// the bodies whose left end is from a diameter left of the box to its right end
+	std::vector<SweepAndPrune::Entry> const &entries = world->sweep_and_prune.entries;
+	auto scan = [&](float from, float to)
+	{
+	    auto i = std::lower_bound(entries.begin(), entries.end(), from,
+				      [](SweepAndPrune::Entry const &entry, float x) {return entry.min_x < x;});
+	    for (; i != entries.end() && i->min_x <= to; ++i)
+		f(i->body);
+	};
+	float from = min.x - 2 * world->sweep_and_prune.max_radius, to = max.x;
+	float width = world->width;
+	if (!world->periodic)
+	    scan(from, to);
+	else if (to - from >= width)
+	    scan(-INFINITY, INFINITY);
+	else
+	{
+	    // the left ends are within a radius of the world, the span is narrower
+	    // than the world: its three images do not overlap
+	    float shift = width * floorf(from / width);
+	    for (float image : {-width, 0.f, width})
+		scan(from - shift + image, to - shift + image);
+	}
+	break;
+    }
+    }
+}
+
+/// Call f with every body that overlaps the box
+template <typename F>
+void query_area(PhysicsWorld const *world, glm::vec2 min, glm::vec2 max, F f)
+{
+    glm::vec2 center = (min + max) * 0.5f;
+    visit_bodies_near(world, min, max, [&](Body *body)
+	{
+	    glm::vec2 pos = center + nearest_image(world, body->pos - center);
+	    glm::vec2 gap = pos - glm::clamp(pos, min, max);
+	    float radius = body->radius();
+	    if (glm::dot(gap, gap) <= radius * radius)
+		f(body);
+	});
+}
+
+/// Call f with every body that overlaps the circle
+template <typename F>
+void query_radius(PhysicsWorld const *world, glm::vec2 center, float radius, F f)
+{
+    visit_bodies_near(world, center - glm::vec2(radius, radius), center + glm::vec2(radius, radius),
+		      [&](Body *body)
+	{
+	    glm::vec2 sub = nearest_image(world, body->pos - center);
+	    float reach = radius + body->radius();
+	    if (glm::dot(sub, sub) <= reach * reach)
+		f(body);
+	});
+}
+
+struct NearestBody
+{
+    Body *body;
+    /// between the centers
+    float distance;
+};
+
+/// The k bodies whose centers are nearest to the point, nearest first, into
+/// nearest, which has room for k. Returns how many were found, less than k only
+/// if there are less bodies.
+size_t query_nearest(PhysicsWorld const *world, glm::vec2 point, size_t k, NearestBody *nearest);
+/// The body under the point, of several the one whose center is nearest, nullptr if none
+Body *pick_body(PhysicsWorld const *world, glm::vec2 point);
+
+#endif
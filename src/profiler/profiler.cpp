@@ -0,0 +1,200 @@
+#include "Logger.hpp"
+#include "profiler.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <iomanip>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+
+std::atomic<bool> profiler_enabled{false};
+
+namespace
+{
+
+std::chrono::steady_clock::time_point const profile_epoch = std::chrono::steady_clock::now();
+
+/// All rings, they live until the end of the process,
+/// so that the timings of finished threads can still be exported
+std::mutex rings_mutex;
+std::vector<std::unique_ptr<ProfileRing>> rings;
+
+thread_local ProfileRing *thread_ring = nullptr;
+
+ProfileRing *get_thread_ring()
+{
+    if (!thread_ring)
+    {
+	std::lock_guard<std::mutex> lock(rings_mutex);
+	rings.emplace_back(new ProfileRing());
+	thread_ring = rings.back().get();
+	thread_ring->thread_index = rings.size() - 1;
+	thread_ring->thread_name = "thread " + std::to_string(thread_ring->thread_index);
+    }
+    return thread_ring;
+}
+
+/// The events of every ring that were not overwritten while copying
+std::vector<std::pair<ProfileRing const *, ProfileEvent>> collect_events()
+{
+    std::vector<std::pair<ProfileRing const *, ProfileEvent>> events;
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    for (auto const &ring : rings)
+    {
+	uint64_t head = ring->head.load(std::memory_order_acquire);
+	uint64_t first = head > PROFILE_RING_SIZE ? head - PROFILE_RING_SIZE : 0;
+	size_t begin = events.size();
+	for (uint64_t i = first; i != head; ++i)
+	    events.push_back(std::make_pair(ring.get(), ring->events[i % PROFILE_RING_SIZE]));
+	// the owner kept writing: drop the oldest copies, their slots may have been reused
+	uint64_t new_head = ring->head.load(std::memory_order_acquire);
+	if (new_head > first + PROFILE_RING_SIZE)
+	{
+	    size_t drop = std::min<uint64_t>(new_head - first - PROFILE_RING_SIZE, head - first);
+	    events.erase(events.begin() + begin, events.begin() + begin + drop);
+	}
+    }
+    return events;
+}
+
+}  // namespace
+
+void enable_profiler(bool enabled)
+{
+    profiler_enabled.store(enabled, std::memory_order_relaxed);
+}
+
+uint64_t profile_now()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+	std::chrono::steady_clock::now() - profile_epoch).count();
+}
+
+void set_profile_thread_name(std::string const &name)
+{
+    ProfileRing *ring = get_thread_ring();
+    std::lock_guard<std::mutex> lock(rings_mutex);
+    ring->thread_name = name;
+}
+
+void record_profile_event(const char *name, uint64_t start, uint64_t duration)
+{
+    ProfileRing *ring = get_thread_ring();
+    uint64_t head = ring->head.load(std::memory_order_relaxed);
+    ProfileEvent &event = ring->events[head % PROFILE_RING_SIZE];
+    event.name = name;
+    event.start = start;
+    event.duration = duration;
+    ring->head.store(head + 1, std::memory_order_release);
+}
+
+std::vector<ProfileStats> profile_stats()
+{
+    std::map<const char *, std::vector<uint64_t>> durations;
+    for (auto const &event : collect_events())
+	durations[event.second.name].push_back(event.second.duration);
+
+    std::vector<ProfileStats> all_stats;
+    for (auto &name_durations : durations)
+    {
+	std::vector<uint64_t> &sorted = name_durations.second;
+	std::sort(sorted.begin(), sorted.end());
+	ProfileStats stats = ProfileStats();
+	stats.name = name_durations.first;
+	stats.count = sorted.size();
+	double sum = 0;
+	for (uint64_t duration : sorted)
+	{
+	    sum+= duration;
+	    int bucket = 0;
+	    for (uint64_t us = duration / 1000; us > 1 && bucket + 1 < ProfileStats::BUCKETS; us/= 2)
+		++bucket;
+	    stats.histogram[bucket]++;
+	}
+	// in microseconds
+	stats.mean = sum / sorted.size() / 1000;
+	stats.p50 = sorted[(sorted.size() - 1) * 50 / 100] / 1000.;
+	stats.p99 = sorted[(sorted.size() - 1) * 99 / 100] / 1000.;
+	stats.max = sorted.back() / 1000.;
+	all_stats.push_back(stats);
+    }
+    std::sort(all_stats.begin(), all_stats.end(), [](ProfileStats const &a, ProfileStats const &b)
+    {
+	return a.p99 > b.p99;
+    });
+    return all_stats;
+}
+
+void print_profile_stats(std::ostream &out)
+{
+    out << std::setw(24) << std::left << "phase" << std::right
+	<< std::setw(8) << "count" << std::setw(12) << "mean us"
+	<< std::setw(12) << "p50 us" << std::setw(12) << "p99 us" << std::setw(12) << "max us" << "\n";
+    for (ProfileStats const &stats : profile_stats())
+    {
+	out << std::setw(24) << std::left << stats.name << std::right
+	    << std::setw(8) << stats.count << std::fixed << std::setprecision(1)
+	    << std::setw(12) << stats.mean << std::setw(12) << stats.p50
+	    << std::setw(12) << stats.p99 << std::setw(12) << stats.max << "\n";
+	// the non-empty buckets, by their upper bound
+	out << std::setw(24) << "";
+	for (int i = 0; i != ProfileStats::BUCKETS; ++i)
+	    if (stats.histogram[i])
+		out << " <" << (2ull << i) << "us:" << stats.histogram[i];
+	out << "\n";
+    }
+}
+
+bool export_profile_csv(const char *filename)
+{
+    FILE *file = fopen(filename, "w");
+    if (!file)
+    {
+	LOG_MSG("Cannot open ", filename, " for writing");
+	return false;
+    }
+    fprintf(file, "thread,name,start_us,duration_us\n");
+    for (auto const &event : collect_events())
+	fprintf(file, "%u,%s,%.3f,%.3f\n", event.first->thread_index, event.second.name,
+		event.second.start / 1000., event.second.duration / 1000.);
+    bool ok = fclose(file) == 0;
+    if (ok)
+	LOG_MSG("Wrote profile ", filename);
+    return ok;
+}
+
+bool export_profile_trace(const char *filename)
+{
+    FILE *file = fopen(filename, "w");
+    if (!file)
+    {
+	LOG_MSG("Cannot open ", filename, " for writing");
+	return false;
+    }
+    fprintf(file, "{\"traceEvents\":[\n");
+    bool first = true;
+    {
+	std::lock_guard<std::mutex> lock(rings_mutex);
+	for (auto const &ring : rings)
+	{
+	    fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":0,\"tid\":%u,"
+		    "\"args\":{\"name\":\"%s\"}}", first ? "" : ",\n",
+		    ring->thread_index, ring->thread_name.c_str());
+	    first = false;
+	}
+    }
+    // complete events, the names are literals without characters that need escaping
+    for (auto const &event : collect_events())
+    {
+	fprintf(file, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+		first ? "" : ",\n", event.second.name, event.first->thread_index,
+		event.second.start / 1000., event.second.duration / 1000.);
+	first = false;
+    }
+    fprintf(file, "\n]}\n");
+    bool ok = fclose(file) == 0;
+    if (ok)
+	LOG_MSG("Wrote trace ", filename);
+    return ok;
+}
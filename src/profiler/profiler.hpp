@@ -0,0 +1,93 @@
+#ifndef PROFILER_HPP_INCLUDED
+#define PROFILER_HPP_INCLUDED
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <iosfwd>
+#include <string>
+#include <vector>
+
+/// Scoped timers for the phases of a frame.
+///
+/// PROFILE_SCOPE("name") times the rest of the enclosing block. Every thread
+/// writes its timings into a ring of its own, without locks; the rings keep
+/// the last PROFILE_RING_SIZE timings of every thread, from which the
+/// statistics and exports are computed. While the profiler is disabled,
+/// a scope costs one relaxed load.
+/// Names have to be string literals (they are stored as pointers).
+
+constexpr size_t PROFILE_RING_SIZE = 1 << 14;
+
+struct ProfileEvent
+{
+    const char *name;
+    /// nanoseconds since the start of the profiler
+    uint64_t start, duration;
+};
+
+/// Written by its thread only, read by the exporters
+struct ProfileRing
+{
+    ProfileEvent events[PROFILE_RING_SIZE];
+    /// number of events ever written, events[head % PROFILE_RING_SIZE] is next
+    std::atomic<uint64_t> head{0};
+    uint32_t thread_index;
+    std::string thread_name;
+};
+
+struct ProfileStats
+{
+    const char *name;
+    size_t count;
+    double mean, p50, p99, max;
+    /// counts of durations in [2^i, 2^(i+1)) microseconds, the first bucket
+    /// includes everything below 2 microseconds
+    static constexpr int BUCKETS = 24;
+    size_t histogram[BUCKETS];
+};
+
+extern std::atomic<bool> profiler_enabled;
+
+void enable_profiler(bool enabled);
+uint64_t profile_now();
+/// Name the calling thread in the exports
+void set_profile_thread_name(std::string const &name);
+void record_profile_event(const char *name, uint64_t start, uint64_t duration);
+
+/// Statistics per name over the events still in the rings, slowest p99 first
+std::vector<ProfileStats> profile_stats();
+void print_profile_stats(std::ostream &out);
+/// thread, name, start and duration in microseconds
+bool export_profile_csv(const char *filename);
+/// Chrome trace_event format, for chrome://tracing or Perfetto
+bool export_profile_trace(const char *filename);
+
+class ProfileScope
+{
+private:
+    const char *name_;
+    uint64_t start_;
+
+public:
+    explicit ProfileScope(const char *name)
+	: name_(profiler_enabled.load(std::memory_order_relaxed) ? name : nullptr),
+	  start_(name_ ? profile_now() : 0)
+    {
+    }
+
+    ~ProfileScope()
+    {
+	if (name_)
+	    record_profile_event(name_, start_, profile_now() - start_);
+    }
+
+    ProfileScope(ProfileScope const &) = delete;
+    ProfileScope &operator =(ProfileScope const &) = delete;
+};
+
+#define PROFILE_CONCAT_(a, b) a##b
+#define PROFILE_CONCAT(a, b) PROFILE_CONCAT_(a, b)
+#define PROFILE_SCOPE(name) ProfileScope PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+
+#endif
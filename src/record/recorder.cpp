@@ -0,0 +1,393 @@
+#include "Logger.hpp"
+#include "recorder.hpp"
+#include "physics/physics.hpp"
+#include "logic/logic.hpp"
+#include <chrono>
+#include <cstring>
+#include <zlib.h>
+
+static_assert(sizeof(TrajectoryFooter) == 24, "trajectory layout changed, bump TRAJECTORY_VERSION");
+static_assert(sizeof(TrajectoryIndexEntry) == 16, "trajectory layout changed, bump TRAJECTORY_VERSION");
+
+/// XOR the values with the previous ones and split them into byte planes
+void encode_values(uint32_t const *values, uint32_t const *previous, size_t count, char *out)
+{
+    for (size_t i = 0; i != count; ++i)
+    {
+	uint32_t v = values[i] ^ (previous ? previous[i] : 0);
+	out[i] = v;
+	out[count + i] = v >> 8;
+	out[count * 2 + i] = v >> 16;
+	out[count * 3 + i] = v >> 24;
+    }
+}
+
+void decode_values(char const *in, uint32_t const *previous, size_t count, uint32_t *values)
+{
+    unsigned char const *bytes = (unsigned char const *)in;
+    for (size_t i = 0; i != count; ++i)
+    {
+	uint32_t v = bytes[i]
+	    | bytes[count + i] << 8
+	    | bytes[count * 2 + i] << 16
+	    | (uint32_t)bytes[count * 3 + i] << 24;
+	values[i] = v ^ (previous ? previous[i] : 0);
+    }
+}
+
+bool write_chunk(TrajectoryRecorder *recorder)
+{
+    if (recorder->chunk_frames == 0)
+	return true;
+    if (recorder->write_failed)
+    {
+	recorder->chunk.clear();
+	recorder->chunk_frames = 0;
+	return false;
+    }
+
+    uLongf compressed_size = compressBound(recorder->chunk.size());
+    recorder->compressed.resize(compressed_size);
+    if (compress2((Bytef *)recorder->compressed.data(), &compressed_size,
+		  (Bytef const *)recorder->chunk.data(), recorder->chunk.size(), 1) != Z_OK)
+    {
+	LOG_MSG("Cannot compress trajectory chunk");
+	recorder->chunk.clear();
+	recorder->chunk_frames = 0;
+	recorder->write_failed = true;
+	return false;
+    }
+
+    TrajectoryIndexEntry entry = TrajectoryIndexEntry();
+    entry.offset = ftell(recorder->file);
+    entry.first_frame = recorder->chunk_first_frame;
+    entry.frame_count = recorder->chunk_frames;
+    recorder->index.push_back(entry);
+
+    TrajectoryChunkHeader header = TrajectoryChunkHeader();
+    header.first_frame = recorder->chunk_first_frame;
+    header.frame_count = recorder->chunk_frames;
+    header.raw_size = recorder->chunk.size();
+    header.compressed_size = compressed_size;
+    recorder->chunk.clear();
+    recorder->chunk_frames = 0;
+    if (fwrite(&header, sizeof(header), 1, recorder->file) != 1
+	|| fwrite(recorder->compressed.data(), 1, compressed_size, recorder->file) != compressed_size)
+    {
+	recorder->index.pop_back();
+	recorder->write_failed = true;
+	return false;
+    }
+    return true;
+}
+
+/// Delta encode the frame into the current chunk
+void encode_frame(TrajectoryRecorder *recorder, TrajectoryFrame const &frame)
+{
+    if (recorder->chunk_frames == 0)
+	recorder->chunk_first_frame = recorder->frames_written;
+
+    size_t count = trajectory_value_count(frame.body_count, frame.cell_count);
+    bool delta = recorder->chunk_frames > 0
+	&& frame.body_count == recorder->previous_bodies
+	&& frame.cell_count == recorder->previous_cells;
+
+    TrajectoryFrameHeader header = TrajectoryFrameHeader();
+    header.frame = frame.frame;
+    header.body_count = frame.body_count;
+    header.cell_count = frame.cell_count;
+    size_t offset = recorder->chunk.size();
+    recorder->chunk.resize(offset + sizeof(header) + count * sizeof(uint32_t));
+    memcpy(&recorder->chunk[offset], &header, sizeof(header));
+
+    uint32_t const *values = frame.values.data();
+    encode_values(values, delta ? recorder->previous.data() : 0, count,
+		  &recorder->chunk[offset + sizeof(header)]);
+
+    recorder->previous.assign(values, values + count);
+    recorder->previous_bodies = frame.body_count;
+    recorder->previous_cells = frame.cell_count;
+    recorder->frames_written++;
+
+    if (++recorder->chunk_frames == TRAJECTORY_FRAMES_PER_CHUNK)
+	write_chunk(recorder);
+}
+
+void recorder_writer(TrajectoryRecorder *recorder)
+{
+    for (;;)
+    {
+	uint64_t tail = recorder->tail.load(std::memory_order_relaxed);
+	if (tail == recorder->head.load(std::memory_order_acquire))
+	{
+	    if (recorder->quit.load(std::memory_order_acquire)
+		&& tail == recorder->head.load(std::memory_order_acquire))
+		break;
+	    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+	    continue;
+	}
+
+	encode_frame(recorder, recorder->ring[tail % TrajectoryRecorder::RING_SIZE]);
+	recorder->tail.store(tail + 1, std::memory_order_release);
+    }
+
+    write_chunk(recorder);
+    // without index and footer, the reader only finds the chunks before the failure
+    if (recorder->write_failed)
+	return;
+
+    // index & footer
+    TrajectoryFooter footer = TrajectoryFooter();
+    footer.index_offset = ftell(recorder->file);
+    footer.chunk_count = recorder->index.size();
+    footer.frame_count = recorder->frames_written;
+    memcpy(footer.magic, TRAJECTORY_MAGIC, sizeof(footer.magic));
+    if (fwrite(recorder->index.data(), sizeof(TrajectoryIndexEntry), recorder->index.size(),
+	       recorder->file) != recorder->index.size()
+	|| fwrite(&footer, sizeof(footer), 1, recorder->file) != 1)
+	recorder->write_failed = true;
+}
+
+bool start_recorder(TrajectoryRecorder *recorder, const char *filename)
+{
+    recorder->file = fopen(filename, "wb");
+    if (!recorder->file)
+    {
+	LOG_MSG("Cannot open ", filename, " for writing");
+	return false;
+    }
+
+    TrajectoryFileHeader header = TrajectoryFileHeader();
+    memcpy(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic));
+    header.version = TRAJECTORY_VERSION;
+    header.frames_per_chunk = TRAJECTORY_FRAMES_PER_CHUNK;
+    if (fwrite(&header, sizeof(header), 1, recorder->file) != 1)
+    {
+	LOG_MSG("Cannot write ", filename);
+	fclose(recorder->file);
+	recorder->file = 0;
+	return false;
+    }
+
+    for (TrajectoryFrame &frame: recorder->ring)
+	frame.values.resize(trajectory_value_count(MAX_BODIES, MAX_CELLS));
+    recorder->frame_body_index.resize(MAX_BODIES);
+
+    recorder->writer = std::thread(recorder_writer, recorder);
+    return true;
+}
+
+void record_frame(TrajectoryRecorder *recorder, PhysicsWorld *physics, LogicWorld *logic)
+{
+    uint32_t frame_number = recorder->next_frame++;
+
+    uint64_t head = recorder->head.load(std::memory_order_relaxed);
+    if (head - recorder->tail.load(std::memory_order_acquire) == TrajectoryRecorder::RING_SIZE)
+    {
+	recorder->dropped++;
+	return;
+    }
+
+    TrajectoryFrame &frame = recorder->ring[head % TrajectoryRecorder::RING_SIZE];
+    frame.frame = frame_number;
+    uint32_t bodies = 0;
+    physics->bodies.iter().do_each([&](Body *) {++bodies;});
+    uint32_t cells = 0;
+    logic->cells.iter().do_each([&](Cell *) {++cells;});
+    frame.body_count = bodies;
+    frame.cell_count = cells;
+
+    float *body_out = (float *)&frame.values[0];
+    uint32_t *id_out = &frame.values[bodies * 3];
+    uint32_t index = 0;
+    physics->bodies.iter_nonempty_slots().do_each([&](ConcurrentSlot<Body> *slot)
+    {
+	Body const &body = slot->value();
+	*body_out++ = body.pos.x;
+	*body_out++ = body.pos.y;
+	*body_out++ = body.angle;
+	size_t slot_index = physics->bodies.index_of(slot);
+	*id_out++ = slot_index;
+	*id_out++ = slot->generation();
+	recorder->frame_body_index[slot_index] = index++;
+    });
+    float *charge_out = (float *)&frame.values[bodies * 5];
+    uint32_t *cell_body_out = &frame.values[bodies * 5 + cells];
+    logic->cells.iter().do_each([&](Cell *cell)
+    {
+	*charge_out++ = cell->charge;
+	*cell_body_out++ = recorder->frame_body_index[physics->bodies.index_of(cell->body_slot)];
+    });
+
+    recorder->head.store(head + 1, std::memory_order_release);
+}
+
+bool stop_recorder(TrajectoryRecorder *recorder)
+{
+    if (!recorder->file)
+	return true;
+    recorder->quit.store(true, std::memory_order_release);
+    recorder->writer.join();
+    if (fclose(recorder->file) != 0)
+	recorder->write_failed = true;
+    recorder->file = 0;
+    if (recorder->dropped)
+	LOG_MSG("Trajectory recorder dropped ", recorder->dropped, " frames");
+    if (recorder->write_failed)
+	LOG_MSG("Cannot write the trajectory, the file is incomplete");
+    return !recorder->write_failed;
+}
+
+/// Rebuild the index from the chunk headers (file was not closed properly)
+bool scan_chunks(TrajectoryReader *reader)
+{
+    fseek(reader->file, sizeof(TrajectoryFileHeader), SEEK_SET);
+    TrajectoryChunkHeader header;
+    for (;;)
+    {
+	long offset = ftell(reader->file);
+	if (fread(&header, sizeof(header), 1, reader->file) != 1)
+	    break;
+	if (fseek(reader->file, header.compressed_size, SEEK_CUR) != 0)
+	    break;
+	// a chunk cut off at the end is ignored
+	long end = ftell(reader->file);
+	fseek(reader->file, 0, SEEK_END);
+	if (ftell(reader->file) < end)
+	    break;
+	fseek(reader->file, end, SEEK_SET);
+
+	TrajectoryIndexEntry entry = TrajectoryIndexEntry();
+	entry.offset = offset;
+	entry.first_frame = header.first_frame;
+	entry.frame_count = header.frame_count;
+	reader->index.push_back(entry);
+	reader->frame_count = header.first_frame + header.frame_count;
+    }
+    return true;
+}
+
+bool open_trajectory(TrajectoryReader *reader, const char *filename)
+{
+    reader->file = fopen(filename, "rb");
+    if (!reader->file)
+    {
+	LOG_MSG("Cannot open trajectory ", filename);
+	return false;
+    }
+
+    TrajectoryFileHeader header;
+    if (fread(&header, sizeof(header), 1, reader->file) != 1
+	|| memcmp(header.magic, TRAJECTORY_MAGIC, sizeof(header.magic)) != 0
+	|| header.version != TRAJECTORY_VERSION)
+    {
+	LOG_MSG("Not a trajectory (or unsupported version): ", filename);
+	close_trajectory(reader);
+	return false;
+    }
+
+    TrajectoryFooter footer;
+    if (fseek(reader->file, -(long)sizeof(footer), SEEK_END) == 0
+	&& fread(&footer, sizeof(footer), 1, reader->file) == 1
+	&& memcmp(footer.magic, TRAJECTORY_MAGIC, sizeof(footer.magic)) == 0)
+    {
+	reader->index.resize(footer.chunk_count);
+	reader->frame_count = footer.frame_count;
+	if (fseek(reader->file, footer.index_offset, SEEK_SET) == 0
+	    && fread(reader->index.data(), sizeof(TrajectoryIndexEntry), footer.chunk_count,
+		     reader->file) == footer.chunk_count)
+	    return true;
+	reader->index.clear();
+    }
+
+    LOG_MSG("Trajectory ", filename, " has no index, scanning chunks");
+    return scan_chunks(reader);
+}
+
+void close_trajectory(TrajectoryReader *reader)
+{
+    if (reader->file)
+	fclose(reader->file);
+    reader->file = 0;
+    reader->index.clear();
+    reader->frames.clear();
+    reader->cached_chunk = (size_t)-1;
+}
+
+bool decode_chunk(TrajectoryReader *reader, size_t c)
+{
+    TrajectoryChunkHeader header;
+    if (fseek(reader->file, reader->index[c].offset, SEEK_SET) != 0
+	|| fread(&header, sizeof(header), 1, reader->file) != 1)
+	return false;
+    reader->compressed.resize(header.compressed_size);
+    reader->raw.resize(header.raw_size);
+    uLongf raw_size = header.raw_size;
+    if (fread(reader->compressed.data(), 1, header.compressed_size, reader->file)
+	    != header.compressed_size
+	|| uncompress((Bytef *)reader->raw.data(), &raw_size,
+		      (Bytef const *)reader->compressed.data(), header.compressed_size) != Z_OK
+	|| raw_size != header.raw_size)
+	return false;
+
+    reader->frames.resize(header.frame_count);
+    size_t offset = 0;
+    TrajectoryFrame const *previous = 0;
+    for (TrajectoryFrame &frame: reader->frames)
+    {
+	TrajectoryFrameHeader frame_header;
+	if (offset + sizeof(frame_header) > raw_size)
+	    return false;
+	memcpy(&frame_header, &reader->raw[offset], sizeof(frame_header));
+	offset+= sizeof(frame_header);
+
+	size_t count = trajectory_value_count(frame_header.body_count, frame_header.cell_count);
+	if (offset + count * sizeof(uint32_t) > raw_size)
+	    return false;
+	bool delta = previous
+	    && previous->body_count == frame_header.body_count
+	    && previous->cell_count == frame_header.cell_count;
+	frame.frame = frame_header.frame;
+	frame.body_count = frame_header.body_count;
+	frame.cell_count = frame_header.cell_count;
+	frame.values.resize(count);
+	decode_values(&reader->raw[offset],
+		      delta ? previous->values.data() : 0, count, frame.values.data());
+	offset+= count * sizeof(uint32_t);
+	previous = &frame;
+    }
+
+    reader->cached_chunk = c;
+    return true;
+}
+
+bool read_trajectory_frame(TrajectoryReader *reader, uint32_t frame, TrajectoryFrame *out)
+{
+    if (frame >= reader->frame_count)
+	return false;
+
+    // chunks are in frame order
+    size_t lo = 0, hi = reader->index.size();
+    while (hi - lo > 1)
+    {
+	size_t mid = (lo + hi) / 2;
+	if (reader->index[mid].first_frame <= frame)
+	    lo = mid;
+	else
+	    hi = mid;
+    }
+    if (reader->index.empty()
+	|| frame < reader->index[lo].first_frame
+	|| frame >= reader->index[lo].first_frame + reader->index[lo].frame_count)
+	return false;
+
+    if (reader->cached_chunk != lo && !decode_chunk(reader, lo))
+    {
+	LOG_MSG("Corrupt trajectory chunk ", lo);
+	reader->cached_chunk = (size_t)-1;
+	return false;
+    }
+
+    *out = reader->frames[frame - reader->index[lo].first_frame];
+    return true;
+}
@@ -0,0 +1,147 @@
+#ifndef RECORDER_HPP_INCLUDED
+#define RECORDER_HPP_INCLUDED
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// Trajectory file: body positions and angles and cell charges of every frame.
+///
+/// Layout: TrajectoryFileHeader, chunks, chunk index, TrajectoryFooter.
+/// A chunk is a TrajectoryChunkHeader followed by the zlib compressed frames.
+/// A frame is a TrajectoryFrameHeader followed by the values: x, y, angle per
+/// body in slot order, the slot index and slot generation per body, then the
+/// charge per cell in slot order and the index of the body of every cell in the
+/// bodies of the frame. The slot index and generation identify a body across
+/// frames, the indices into the frame shift when bodies are born or die.
+/// The bits of every value are XORed with the same value of the previous frame
+/// of the chunk (if it had the same counts), and the bytes of the values are
+/// stored as four planes, which makes the mostly unchanged high bytes compress well.
+/// The first frame of a chunk is not delta encoded, so chunks decode independently.
+/// If the file was not closed properly, the index is rebuilt from the chunk headers.
+/// Frames are numbered in file order, TrajectoryFrame::frame is the number of
+/// the simulation frame (they differ when frames were dropped).
+
+#define TRAJECTORY_MAGIC "CELLTRAJ"
+constexpr uint32_t TRAJECTORY_VERSION = 2;
+constexpr uint32_t TRAJECTORY_FRAMES_PER_CHUNK = 64;
+
+struct TrajectoryFileHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t frames_per_chunk;
+};
+
+struct TrajectoryChunkHeader
+{
+    uint32_t first_frame, frame_count;
+    uint32_t raw_size, compressed_size;
+};
+
+struct TrajectoryFrameHeader
+{
+    uint32_t frame, body_count, cell_count;
+};
+
+struct TrajectoryIndexEntry
+{
+    uint64_t offset;
+    uint32_t first_frame, frame_count;
+};
+
+struct TrajectoryFooter
+{
+    uint64_t index_offset;
+    uint32_t chunk_count, frame_count;
+    char magic[8];
+};
+
+/// One frame as copied from the worlds
+struct TrajectoryFrame
+{
+    uint32_t frame = 0;
+    uint32_t body_count = 0, cell_count = 0;
+    /// bits of body_count * 3 floats (x, y, angle), body_count * 2 ids
+    /// (slot index, generation), cell_count float charges, cell_count body indices
+    std::vector<uint32_t> values;
+
+    /// x, y, angle
+    float const *body(size_t i) const { return (float const *)&values[i * 3]; }
+    uint32_t body_slot(size_t i) const { return values[body_count * 3 + i * 2]; }
+    uint32_t body_generation(size_t i) const { return values[body_count * 3 + i * 2 + 1]; }
+    float charge(size_t i) const { return *(float const *)&values[body_count * 5 + i]; }
+    /// index of the body of the cell in this frame, -> body()
+    uint32_t cell_body(size_t i) const { return values[body_count * 5 + cell_count + i]; }
+};
+
+/// Values of a frame with the given counts
+inline size_t trajectory_value_count(size_t body_count, size_t cell_count)
+{
+    return body_count * 5 + cell_count * 2;
+}
+
+/// Records frames on the simulation thread into a lock free
+/// single producer / single consumer ring, from which a writer thread
+/// encodes, compresses and writes them.
+/// If the writer falls behind and the ring is full, frames are dropped (and counted)
+/// instead of stalling the simulation.
+struct TrajectoryRecorder
+{
+    static constexpr size_t RING_SIZE = 64;
+    /// Preallocated, so recording does not allocate
+    TrajectoryFrame ring[RING_SIZE];
+    /// written by the simulation thread only
+    std::atomic<uint64_t> head{0};
+    /// written by the writer thread only
+    std::atomic<uint64_t> tail{0};
+    std::atomic<bool> quit{false};
+    uint32_t next_frame = 0;
+    size_t dropped = 0;
+    /// scratch of record_frame(): index in the frame of the body in each slot
+    std::vector<uint32_t> frame_body_index;
+
+    std::thread writer;
+    FILE *file = 0;
+    // writer state
+    std::vector<uint32_t> previous;
+    uint32_t previous_bodies = 0, previous_cells = 0;
+    std::vector<char> chunk;
+    uint32_t chunk_first_frame = 0, chunk_frames = 0;
+    std::vector<char> compressed;
+    std::vector<TrajectoryIndexEntry> index;
+    uint32_t frames_written = 0;
+    /// a write failed, the frames after it are dropped
+    bool write_failed = false;
+};
+
+bool start_recorder(TrajectoryRecorder *recorder, const char *filename);
+/// Copy the current state into the ring, to be called once per frame
+void record_frame(TrajectoryRecorder *recorder,
+		  struct PhysicsWorld *physics, struct LogicWorld *logic);
+/// Write the remaining frames, the index and close the file.
+/// False if a write failed, the file is incomplete then.
+bool stop_recorder(TrajectoryRecorder *recorder);
+
+/// Random access to the frames of a trajectory file.
+/// The last decoded chunk is cached, so reading frames in order is cheap.
+struct TrajectoryReader
+{
+    FILE *file = 0;
+    std::vector<TrajectoryIndexEntry> index;
+    uint32_t frame_count = 0;
+
+    // the last decoded chunk
+    size_t cached_chunk = (size_t)-1;
+    std::vector<TrajectoryFrame> frames;
+    std::vector<char> compressed, raw;
+};
+
+bool open_trajectory(TrajectoryReader *reader, const char *filename);
+void close_trajectory(TrajectoryReader *reader);
+bool read_trajectory_frame(TrajectoryReader *reader, uint32_t frame, TrajectoryFrame *out);
+
+#endif
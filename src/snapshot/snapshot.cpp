@@ -0,0 +1,632 @@
+#include "Logger.hpp"
+#include "snapshot.hpp"
+#include "physics/physics.hpp"
+#include "logic/logic.hpp"
+#include <cstdio>
+#include <cstring>
+#include <type_traits>
+#include <unordered_map>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static_assert(sizeof(SnapshotHeader) == 76, "snapshot layout changed, bump SNAPSHOT_VERSION");
+static_assert(sizeof(SnapshotBody) == 36, "snapshot layout changed, bump SNAPSHOT_VERSION");
+static_assert(sizeof(SnapshotCellType) == 92, "snapshot layout changed, bump SNAPSHOT_VERSION");
+
+/// Reserve room for count records at the end of the buffer, returns their offset
+template <typename T>
+uint32_t append_records(std::vector<char> *buffer, size_t count)
+{
+    size_t offset = buffer->size();
+    buffer->resize(offset + count * sizeof(T));
+    return offset;
+}
+
+template <typename T>
+T *record(std::vector<char> *buffer, uint32_t offset, size_t i)
+{
+    return reinterpret_cast<T *>(&(*buffer)[offset]) + i;
+}
+
+template <typename T>
+SnapshotRange append_list(std::vector<SnapshotTypeListEntry> *lists, T const &list,
+			  SnapshotTypeListEntry (*convert)(typename std::decay<decltype(list[0])>::type const &))
+{
+    SnapshotRange range = {(uint32_t)lists->size(), (uint32_t)list.size()};
+    for (size_t i = 0; i != list.size(); ++i)
+	lists->push_back(convert(list[i]));
+    return range;
+}
+
+void write_snapshot(PhysicsWorld *physics, LogicWorld *logic, std::vector<char> *buffer)
+{
+    // number everything in slot order
+    std::unordered_map<Body const *, uint32_t> body_indices;
+    std::unordered_map<Slot<Attachment> const *, uint32_t> attachment_indices;
+    std::unordered_map<Slot<CellType> const *, uint32_t> type_indices;
+    std::unordered_map<Cell const *, uint32_t> cell_indices;
+    physics->bodies.iter().do_each([&](Body *body)
+    {
+	body_indices.emplace(body, body_indices.size());
+    });
+    physics->attachments.iter_nonempty_slots().do_each([&](Slot<Attachment> *slot)
+    {
+	attachment_indices.emplace(slot, attachment_indices.size());
+    });
+    logic->cell_types.iter_nonempty_slots().do_each([&](Slot<CellType> *slot)
+    {
+	type_indices.emplace(slot, type_indices.size());
+    });
+    // cells in bucket order, so that the loaded world updates them in the same order
+    std::vector<Cell *> cells;
+    size_t cell_attachment_count = 0;
+    for (size_t tag = 0; tag != CELL_TYPE_TAGS; ++tag)
+	for (ConcurrentSlot<Cell> *slot: logic->buckets[tag])
+	{
+	    cell_indices.emplace(&slot->value(), cells.size());
+	    cells.push_back(&slot->value());
+	    cell_attachment_count+= slot->value().attachments.size();
+	}
+
+    auto type_index = [&](Slot<CellType> const *slot)
+    {
+	auto i = type_indices.find(slot);
+	return i == type_indices.end() ? SNAPSHOT_NONE : i->second;
+    };
+
+    buffer->clear();
+    append_records<SnapshotHeader>(buffer, 1);
+    SnapshotHeader header = SnapshotHeader();
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.header_size = sizeof(SnapshotHeader);
+    header.room_width = physics->body_rooms.room_width;
+    header.room_height = physics->body_rooms.room_height;
+    header.body_count = body_indices.size();
+    header.attachment_count = attachment_indices.size();
+    header.cell_type_count = type_indices.size();
+    header.cell_count = cell_indices.size();
+    header.cell_attachment_count = cell_attachment_count;
+
+    // bodies
+    header.bodies_offset = append_records<SnapshotBody>(buffer, header.body_count);
+    uint32_t i = 0;
+    physics->bodies.iter().do_each([&](Body *body)
+    {
+	SnapshotBody *out = record<SnapshotBody>(buffer, header.bodies_offset, i++);
+	out->pos[0] = body->pos.x;
+	out->pos[1] = body->pos.y;
+	out->vel[0] = body->vel.x;
+	out->vel[1] = body->vel.y;
+	out->angle = body->angle;
+	out->angle_vel = body->angle_vel;
+	out->mass = body->mass;
+	out->mass_per_radius = body->mass_per_radius;
+	out->fixed = body->fixed;
+    });
+
+    // attachments
+    header.attachments_offset = append_records<SnapshotAttachment>(buffer, header.attachment_count);
+    i = 0;
+    physics->attachments.iter().do_each([&](Attachment *attachment)
+    {
+	SnapshotAttachment *out = record<SnapshotAttachment>(buffer, header.attachments_offset, i++);
+	out->distance = attachment->config.distance;
+	out->delta_angle = attachment->config.delta_angle;
+	out->strength = attachment->config.strength;
+	out->bodies[0] = body_indices.at(attachment->bodies[0]);
+	out->bodies[1] = body_indices.at(attachment->bodies[1]);
+    });
+
+    // cell types, their lists are collected separately
+    std::vector<SnapshotTypeListEntry> type_lists;
+    header.cell_types_offset = append_records<SnapshotCellType>(buffer, header.cell_type_count);
+    i = 0;
+    logic->cell_types.iter().do_each([&](CellType *type)
+    {
+	SnapshotCellType *out = record<SnapshotCellType>(buffer, header.cell_types_offset, i++);
+	*out = SnapshotCellType();
+	out->tag = type->_tag;
+	out->fix_input_attachment = SNAPSHOT_NONE;
+	switch (type->_tag)
+	{
+	case CellType::STEM_CELL:
+	{
+	    StemCell const &stem = type->stem_cell;
+	    out->has_child_attachment = !stem.optional_child_attachment.empty;
+	    if (out->has_child_attachment)
+	    {
+		AttachmentConfig const &config = stem.optional_child_attachment.value();
+		out->child_attachment[0] = config.distance;
+		out->child_attachment[1] = config.delta_angle;
+		out->child_attachment[2] = config.strength;
+	    }
+	    for (int c = 0; c != 2; ++c)
+	    {
+		out->children_angles[c] = stem.children_angles[c];
+		out->children_types[c] = type_index(stem.children_types[c]);
+		out->passed_attachments[c] = append_list(&type_lists, stem.passed_attachments[c],
+		    [](size_t const &att)
+		    {
+			return SnapshotTypeListEntry{(uint32_t)att, 0, 0};
+		    });
+	    }
+	    out->min_split_mass = stem.min_split_mass;
+	    out->child0_amount = stem.child0_amount;
+	    break;
+	}
+	case CellType::MUSCLE_CELL:
+	{
+	    MuscleCellType const &muscle = type->muscle_cell;
+	    if (!muscle.fix_input_attachment.empty)
+		out->fix_input_attachment = muscle.fix_input_attachment.value();
+	    out->control_inputs = append_list(&type_lists, muscle.control_inputs,
+	        [](MuscleInput const &input)
+		{
+		    return SnapshotTypeListEntry{(uint32_t)input.input_attachment,
+			                         (uint32_t)input.output_attachment,
+			                         input.weight};
+		});
+	    break;
+	}
+	case CellType::NEURON_CELL:
+	{
+	    NeuronCellType const &neuron = type->neuron_cell;
+	    out->function = neuron.function;
+	    out->threshold = neuron.threshold;
+	    out->update_offset = neuron.update_offset;
+	    out->inputs = append_list(&type_lists, neuron.inputs,
+	        [](NeuronInput const &input)
+		{
+		    return SnapshotTypeListEntry{(uint32_t)input.attachment, 0, input.weight};
+		});
+	    break;
+	}
+	}
+    });
+
+    header.type_list_count = type_lists.size();
+    header.type_lists_offset = append_records<SnapshotTypeListEntry>(buffer, type_lists.size());
+    if (!type_lists.empty())
+	memcpy(record<SnapshotTypeListEntry>(buffer, header.type_lists_offset, 0),
+	       type_lists.data(), type_lists.size() * sizeof(SnapshotTypeListEntry));
+
+    // cells and their attachments
+    header.cells_offset = append_records<SnapshotCell>(buffer, header.cell_count);
+    header.cell_attachments_offset =
+	append_records<SnapshotCellAttachment>(buffer, header.cell_attachment_count);
+    uint32_t a = 0;
+    for (i = 0; i != cells.size(); ++i)
+    {
+	Cell *cell = cells[i];
+	SnapshotCell *out = record<SnapshotCell>(buffer, header.cells_offset, i);
+	out->type = type_index(cell->type_slot);
+	out->body = body_indices.at(&cell->body());
+	out->life_time = cell->life_time;
+	out->charge = cell->charge;
+	out->neuron_next_update = cell->neuron_next_update;
+	out->attachments.first = a;
+	out->attachments.count = cell->attachments.size();
+	for (Optional<LogicAttachment> const &att: cell->attachments)
+	{
+	    SnapshotCellAttachment *att_out =
+		record<SnapshotCellAttachment>(buffer, header.cell_attachments_offset, a++);
+	    if (att.empty)
+		att_out->other_cell = att_out->physics = SNAPSHOT_NONE;
+	    else
+	    {
+		att_out->other_cell = cell_indices.at(att.value().other_cell);
+		att_out->physics = attachment_indices.at(att.value().physics);
+	    }
+	}
+    }
+
+    header.file_size = buffer->size();
+    *record<SnapshotHeader>(buffer, 0, 0) = header;
+}
+
+bool write_file(const char *filename, std::vector<char> const &buffer)
+{
+    FILE *file = fopen(filename, "wb");
+    if (!file)
+    {
+	LOG_MSG("Cannot open ", filename, " for writing");
+	return false;
+    }
+    bool ok = fwrite(buffer.data(), 1, buffer.size(), file) == buffer.size();
+    ok = fclose(file) == 0 && ok;
+    if (!ok)
+	LOG_MSG("Cannot write ", filename);
+    return ok;
+}
+
+bool save_snapshot(PhysicsWorld *physics, LogicWorld *logic, const char *filename)
+{
+    std::vector<char> buffer;
+    write_snapshot(physics, logic, &buffer);
+    return write_file(filename, buffer);
+}
+
+/// Check that count records at offset lie inside the file
+template <typename T>
+bool in_file(SnapshotHeader const *header, uint32_t offset, uint32_t count)
+{
+    return offset % alignof(T) == 0
+	&& offset >= header->header_size
+	&& (uint64_t)offset + (uint64_t)count * sizeof(T) <= header->file_size;
+}
+
+bool in_range(SnapshotRange range, uint32_t count)
+{
+    return (uint64_t)range.first + range.count <= count;
+}
+
+/// Check that the cell holds exactly one logic attachment to other_cell, over the physics attachment
+bool linked_once(SnapshotCell const &cell, SnapshotCellAttachment const *cell_attachments,
+		 uint32_t other_cell, uint32_t physics)
+{
+    int links = 0;
+    for (uint32_t a = 0; a != cell.attachments.count; ++a)
+    {
+	SnapshotCellAttachment const &att = cell_attachments[cell.attachments.first + a];
+	if (att.other_cell == other_cell)
+	    links+= att.physics == physics ? 1 : 2;
+    }
+    return links == 1;
+}
+
+bool build_worlds(PhysicsWorld *physics, LogicWorld *logic, char const *data, size_t size)
+{
+    SnapshotHeader const *header = reinterpret_cast<SnapshotHeader const *>(data);
+    if (size < sizeof(SnapshotHeader)
+	|| memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(header->magic)) != 0)
+    {
+	LOG_MSG("Not a snapshot");
+	return false;
+    }
+    if (header->version != SNAPSHOT_VERSION || header->header_size != sizeof(SnapshotHeader))
+    {
+	LOG_MSG("Unsupported snapshot version ", header->version);
+	return false;
+    }
+    if (header->file_size != size
+	|| !in_file<SnapshotBody>(header, header->bodies_offset, header->body_count)
+	|| !in_file<SnapshotAttachment>(header, header->attachments_offset, header->attachment_count)
+	|| !in_file<SnapshotCellType>(header, header->cell_types_offset, header->cell_type_count)
+	|| !in_file<SnapshotCell>(header, header->cells_offset, header->cell_count)
+	|| !in_file<SnapshotTypeListEntry>(header, header->type_lists_offset, header->type_list_count)
+	|| !in_file<SnapshotCellAttachment>(header, header->cell_attachments_offset,
+					    header->cell_attachment_count))
+    {
+	LOG_MSG("Truncated snapshot");
+	return false;
+    }
+    if (header->body_count > MAX_BODIES || header->attachment_count > MAX_ATTACHMENTS
+	|| header->cell_count > MAX_CELLS || header->cell_type_count > MAX_CELL_TYPES)
+    {
+	LOG_MSG("Snapshot exceeds the capacity of the world");
+	return false;
+    }
+
+    SnapshotBody const *bodies = reinterpret_cast<SnapshotBody const *>(data + header->bodies_offset);
+    SnapshotAttachment const *attachments =
+	reinterpret_cast<SnapshotAttachment const *>(data + header->attachments_offset);
+    SnapshotCellType const *types =
+	reinterpret_cast<SnapshotCellType const *>(data + header->cell_types_offset);
+    SnapshotTypeListEntry const *lists =
+	reinterpret_cast<SnapshotTypeListEntry const *>(data + header->type_lists_offset);
+    SnapshotCell const *cells = reinterpret_cast<SnapshotCell const *>(data + header->cells_offset);
+    SnapshotCellAttachment const *cell_attachments =
+	reinterpret_cast<SnapshotCellAttachment const *>(data + header->cell_attachments_offset);
+
+    // validate all indices before the worlds are touched
+    bool valid = true;
+    for (uint32_t i = 0; i != header->attachment_count; ++i)
+	valid = valid && attachments[i].bodies[0] < header->body_count
+	              && attachments[i].bodies[1] < header->body_count;
+    for (uint32_t i = 0; i != header->cell_type_count; ++i)
+    {
+	SnapshotCellType const &type = types[i];
+	switch (type.tag)
+	{
+	case CellType::STEM_CELL:
+	    for (int c = 0; c != 2; ++c)
+		valid = valid && type.children_types[c] < header->cell_type_count
+		              && in_range(type.passed_attachments[c], header->type_list_count);
+	    break;
+	case CellType::MUSCLE_CELL:
+	    valid = valid && in_range(type.control_inputs, header->type_list_count);
+	    break;
+	case CellType::NEURON_CELL:
+	    valid = valid && type.function <= NeuronCellType::LINEAR
+		          && in_range(type.inputs, header->type_list_count);
+	    break;
+	default:
+	    valid = false;
+	}
+    }
+    for (uint32_t i = 0; i != header->cell_count; ++i)
+    {
+	valid = valid && cells[i].type < header->cell_type_count
+	              && cells[i].body < header->body_count
+	              && in_range(cells[i].attachments, header->cell_attachment_count);
+	for (uint32_t a = 0; valid && a != cells[i].attachments.count; ++a)
+	{
+	    SnapshotCellAttachment const &att = cell_attachments[cells[i].attachments.first + a];
+	    valid = att.other_cell == SNAPSHOT_NONE
+		|| (att.other_cell < header->cell_count && att.physics < header->attachment_count);
+	}
+    }
+    if (!valid)
+    {
+	LOG_MSG("Corrupt snapshot: index out of range");
+	return false;
+    }
+    // the logic relies on both cells of an attachment holding it, over the
+    // physics attachment between their bodies (-> attach_cells)
+    for (uint32_t i = 0; valid && i != header->cell_count; ++i)
+	for (uint32_t a = 0; valid && a != cells[i].attachments.count; ++a)
+	{
+	    SnapshotCellAttachment const &att = cell_attachments[cells[i].attachments.first + a];
+	    if (att.other_cell == SNAPSHOT_NONE)
+		continue;
+	    uint32_t body = cells[i].body, other_body = cells[att.other_cell].body;
+	    uint32_t const *joined = attachments[att.physics].bodies;
+	    valid = body != other_body
+		&& ((joined[0] == body && joined[1] == other_body)
+		    || (joined[0] == other_body && joined[1] == body))
+		&& linked_once(cells[i], cell_attachments, att.other_cell, att.physics)
+		&& linked_once(cells[att.other_cell], cell_attachments, i, att.physics);
+	}
+    if (!valid)
+    {
+	LOG_MSG("Corrupt snapshot: inconsistent attachments");
+	return false;
+    }
+    if (!(header->room_width > 0 && header->room_height > 0))
+    {
+	LOG_MSG("Corrupt snapshot: room size");
+	return false;
+    }
+
+    // physics
+    set_room_size(physics, header->room_width, header->room_height);
+    std::vector<ConcurrentSlot<Body> *> body_slots(header->body_count);
+    for (uint32_t i = 0; i != header->body_count; ++i)
+    {
+	Body body = Body();
+	body.pos = glm::vec2(bodies[i].pos[0], bodies[i].pos[1]);
+	body.vel = glm::vec2(bodies[i].vel[0], bodies[i].vel[1]);
+	body.angle = bodies[i].angle;
+	body.angle_vel = bodies[i].angle_vel;
+	body.mass = bodies[i].mass;
+	body.mass_per_radius = bodies[i].mass_per_radius;
+	body.fixed = bodies[i].fixed;
+	body.room_x = body.room_y = -1;
+	body_slots[i] = physics->bodies.add(body);
+    }
+    std::vector<Slot<Attachment> *> attachment_slots(header->attachment_count);
+    for (uint32_t i = 0; i != header->attachment_count; ++i)
+    {
+	Attachment attachment = Attachment();
+	attachment.config.distance = attachments[i].distance;
+	attachment.config.delta_angle = attachments[i].delta_angle;
+	attachment.config.strength = attachments[i].strength;
+	attachment.bodies[0] = &body_slots[attachments[i].bodies[0]]->value();
+	attachment.bodies[1] = &body_slots[attachments[i].bodies[1]]->value();
+	attachment_slots[i] = physics->attachments.add(attachment);
+    }
+    publish_bodies(physics);
+    update_broadphase(physics);
+
+    // cell types, children types are resolved when all types exist
+    std::vector<Slot<CellType> *> type_slots(header->cell_type_count);
+    for (uint32_t i = 0; i != header->cell_type_count; ++i)
+    {
+	SnapshotCellType const &in = types[i];
+	CellType type((CellType::CellTypeTag)in.tag);
+	switch (type._tag)
+	{
+	case CellType::STEM_CELL:
+	{
+	    StemCell &stem = type.stem_cell;
+	    if (in.has_child_attachment)
+	    {
+		AttachmentConfig config = AttachmentConfig();
+		config.distance = in.child_attachment[0];
+		config.delta_angle = in.child_attachment[1];
+		config.strength = in.child_attachment[2];
+		stem.optional_child_attachment = optional(config);
+	    }
+	    for (int c = 0; c != 2; ++c)
+	    {
+		stem.children_angles[c] = in.children_angles[c];
+		SnapshotRange range = in.passed_attachments[c];
+		for (uint32_t l = range.first; l != range.first + range.count; ++l)
+		    stem.passed_attachments[c].push_back(lists[l].a);
+	    }
+	    stem.min_split_mass = in.min_split_mass;
+	    stem.child0_amount = in.child0_amount;
+	    break;
+	}
+	case CellType::MUSCLE_CELL:
+	{
+	    MuscleCellType &muscle = type.muscle_cell;
+	    if (in.fix_input_attachment != SNAPSHOT_NONE)
+		muscle.fix_input_attachment = Optional<size_t>(in.fix_input_attachment);
+	    for (uint32_t l = in.control_inputs.first;
+		 l != in.control_inputs.first + in.control_inputs.count; ++l)
+	    {
+		MuscleInput input = MuscleInput();
+		input.input_attachment = lists[l].a;
+		input.output_attachment = lists[l].b;
+		input.weight = lists[l].weight;
+		muscle.control_inputs.push_back(input);
+	    }
+	    break;
+	}
+	case CellType::NEURON_CELL:
+	{
+	    NeuronCellType &neuron = type.neuron_cell;
+	    neuron.function = (NeuronCellType::Function)in.function;
+	    neuron.threshold = in.threshold;
+	    neuron.update_offset = in.update_offset;
+	    for (uint32_t l = in.inputs.first; l != in.inputs.first + in.inputs.count; ++l)
+	    {
+		NeuronInput input = NeuronInput();
+		input.attachment = lists[l].a;
+		input.weight = lists[l].weight;
+		neuron.inputs.push_back(input);
+	    }
+	    break;
+	}
+	}
+	type_slots[i] = logic->cell_types.add(type);
+    }
+    for (uint32_t i = 0; i != header->cell_type_count; ++i)
+	if (types[i].tag == CellType::STEM_CELL)
+	    for (int c = 0; c != 2; ++c)
+		type_slots[i]->value().stem_cell.children_types[c] =
+		    type_slots[types[i].children_types[c]];
+
+    // cells, attachments are resolved when all cells exist
+    std::vector<ConcurrentSlot<Cell> *> cell_slots(header->cell_count);
+    for (uint32_t i = 0; i != header->cell_count; ++i)
+    {
+	Cell cell = Cell();
+	cell.type_slot = type_slots[cells[i].type];
+	cell.body_slot = body_slots[cells[i].body];
+	cell.life_time = cells[i].life_time;
+	cell.charge = cells[i].charge;
+	cell.neuron_next_update = cells[i].neuron_next_update;
+	cell_slots[i] = add_cell(logic, cell);
+    }
+    for (uint32_t i = 0; i != header->cell_count; ++i)
+    {
+	Cell &cell = cell_slots[i]->value();
+	for (uint32_t a = 0; a != cells[i].attachments.count; ++a)
+	{
+	    SnapshotCellAttachment const &in = cell_attachments[cells[i].attachments.first + a];
+	    if (in.other_cell == SNAPSHOT_NONE)
+	    {
+		cell.attachments.push_back(Optional<LogicAttachment>());
+		continue;
+	    }
+	    LogicAttachment att = LogicAttachment();
+	    att.other_cell = &cell_slots[in.other_cell]->value();
+	    att.physics = attachment_slots[in.physics];
+	    cell.attachments.push_back(att);
+	}
+    }
+    logic->cells.publish();
+
+    return true;
+}
+
+bool load_snapshot(PhysicsWorld *physics, LogicWorld *logic, const char *filename)
+{
+    int fd = open(filename, O_RDONLY);
+    if (fd < 0)
+    {
+	LOG_MSG("Cannot open snapshot ", filename);
+	return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+	LOG_MSG("Cannot read snapshot ", filename);
+	close(fd);
+	return false;
+    }
+    void *data = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+	LOG_MSG("Cannot map snapshot ", filename);
+	return false;
+    }
+
+    bool ok = build_worlds(physics, logic, (char const *)data, st.st_size);
+    munmap(data, st.st_size);
+    if (ok)
+	LOG_MSG("Loaded snapshot ", filename);
+    return ok;
+}
+
+void checkpoint_writer(Checkpointer *checkpointer)
+{
+    std::vector<char> writing;
+    std::string tmp_filename = checkpointer->filename + ".tmp";
+    for (;;)
+    {
+	{
+	    std::unique_lock<std::mutex> lock(checkpointer->mutex);
+	    checkpointer->wake_up.wait(lock, [&]
+	    {
+		return checkpointer->has_pending || checkpointer->quit;
+	    });
+	    if (!checkpointer->has_pending)
+		return;
+	    std::swap(writing, checkpointer->pending);
+	    checkpointer->has_pending = false;
+	}
+
+	// write aside and rename, so that there always is a complete checkpoint
+	bool ok = write_file(tmp_filename.c_str(), writing);
+	if (ok && rename(tmp_filename.c_str(), checkpointer->filename.c_str()) != 0)
+	{
+	    LOG_MSG("Cannot rename ", tmp_filename, " to ", checkpointer->filename);
+	    ok = false;
+	}
+	if (!ok)
+	    remove(tmp_filename.c_str());
+    }
+}
+
+void start_checkpointer(Checkpointer *checkpointer, std::string const &filename, float interval)
+{
+    checkpointer->filename = filename;
+    checkpointer->interval = interval;
+    checkpointer->writer = std::thread(checkpoint_writer, checkpointer);
+}
+
+void update_checkpointer(Checkpointer *checkpointer,
+			 PhysicsWorld *physics, LogicWorld *logic, float time)
+{
+    checkpointer->time_since_checkpoint+= time;
+    if (checkpointer->time_since_checkpoint < checkpointer->interval)
+	return;
+    checkpointer->time_since_checkpoint = 0;
+
+    {
+	std::lock_guard<std::mutex> lock(checkpointer->mutex);
+	if (checkpointer->has_pending)
+	{
+	    // the writer did not even pick up the last one
+	    checkpointer->skipped++;
+	    return;
+	}
+    }
+
+    write_snapshot(physics, logic, &checkpointer->scratch);
+
+    {
+	std::lock_guard<std::mutex> lock(checkpointer->mutex);
+	std::swap(checkpointer->scratch, checkpointer->pending);
+	checkpointer->has_pending = true;
+    }
+    checkpointer->wake_up.notify_one();
+}
+
+void stop_checkpointer(Checkpointer *checkpointer)
+{
+    {
+	std::lock_guard<std::mutex> lock(checkpointer->mutex);
+	checkpointer->quit = true;
+    }
+    checkpointer->wake_up.notify_one();
+    if (checkpointer->writer.joinable())
+	checkpointer->writer.join();
+}
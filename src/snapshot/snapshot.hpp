@@ -0,0 +1,141 @@
+#ifndef SNAPSHOT_HPP_INCLUDED
+#define SNAPSHOT_HPP_INCLUDED
+
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/// Binary snapshot of a PhysicsWorld and a LogicWorld.
+///
+/// Layout: a SnapshotHeader, followed by flat arrays of the records below.
+/// Pointers are stored as indices into these arrays
+/// (bodies, attachments, cell types and cells are numbered in slot order).
+/// All fields are 32 bit, little endian, no padding.
+/// Bump SNAPSHOT_VERSION whenever a record changes.
+
+#define SNAPSHOT_MAGIC "CELLSNAP"
+constexpr uint32_t SNAPSHOT_VERSION = 1;
+/// Placeholder for a missing index (empty optional)
+constexpr uint32_t SNAPSHOT_NONE = 0xffffffff;
+
+struct SnapshotRange
+{
+    uint32_t first, count;
+};
+
+struct SnapshotHeader
+{
+    char magic[8];
+    uint32_t version;
+    uint32_t header_size;
+    float room_width, room_height;
+    /// counts and file offsets of the arrays
+    uint32_t body_count, attachment_count, cell_type_count, cell_count;
+    uint32_t type_list_count, cell_attachment_count;
+    uint32_t bodies_offset, attachments_offset, cell_types_offset, cells_offset;
+    uint32_t type_lists_offset, cell_attachments_offset;
+    uint32_t file_size;
+};
+
+struct SnapshotBody
+{
+    float pos[2], vel[2];
+    float angle, angle_vel;
+    float mass, mass_per_radius;
+    uint32_t fixed;
+};
+
+struct SnapshotAttachment
+{
+    float distance, delta_angle, strength;
+    uint32_t bodies[2];
+};
+
+/// One element of the lists of a cell type:
+/// stem passed attachment: a = attachment index
+/// muscle control input: a = input attachment, b = output attachment
+/// neuron input: a = attachment
+struct SnapshotTypeListEntry
+{
+    uint32_t a, b;
+    float weight;
+};
+
+struct SnapshotCellType
+{
+    uint32_t tag;
+    // STEM_CELL
+    uint32_t has_child_attachment;
+    float child_attachment[3];
+    float children_angles[2];
+    uint32_t children_types[2];
+    float min_split_mass, child0_amount;
+    SnapshotRange passed_attachments[2];
+    // MUSCLE_CELL
+    uint32_t fix_input_attachment;
+    SnapshotRange control_inputs;
+    // NEURON_CELL
+    uint32_t function;
+    float threshold, update_offset;
+    SnapshotRange inputs;
+};
+
+struct SnapshotCell
+{
+    uint32_t type, body;
+    float life_time, charge, neuron_next_update;
+    SnapshotRange attachments;
+};
+
+/// other_cell == SNAPSHOT_NONE: removed attachment (the index stays taken)
+struct SnapshotCellAttachment
+{
+    uint32_t other_cell, physics;
+};
+
+/// Serialize the worlds into the buffer (which is cleared first).
+void write_snapshot(struct PhysicsWorld *physics, struct LogicWorld *logic,
+		    std::vector<char> *buffer);
+bool save_snapshot(struct PhysicsWorld *physics, struct LogicWorld *logic,
+		   const char *filename);
+/// Load the snapshot into the given, freshly constructed worlds.
+/// The file is mapped and the worlds are built directly from the mapping.
+/// On failure, the reason is logged and false is returned.
+bool load_snapshot(struct PhysicsWorld *physics, struct LogicWorld *logic,
+		   const char *filename);
+
+/// Periodically writes snapshots in the background.
+/// The simulation thread only serializes into memory,
+/// file output happens on the writer thread.
+/// If the writer is still busy with the last checkpoint, the next one is skipped.
+struct Checkpointer
+{
+    std::string filename;
+    /// simulated seconds between two checkpoints
+    float interval;
+    float time_since_checkpoint = 0;
+
+    std::thread writer;
+    std::mutex mutex;
+    std::condition_variable wake_up;
+    /// serialized into on the simulation thread
+    std::vector<char> scratch;
+    /// handed over to the writer (swapped with scratch)
+    std::vector<char> pending;
+    bool has_pending = false;
+    bool quit = false;
+    size_t skipped = 0;
+};
+
+void start_checkpointer(Checkpointer *checkpointer, std::string const &filename,
+			float interval);
+void update_checkpointer(Checkpointer *checkpointer,
+			 struct PhysicsWorld *physics, struct LogicWorld *logic,
+			 float time);
+/// Write the pending checkpoint and join the writer
+void stop_checkpointer(Checkpointer *checkpointer);
+
+#endif
@@ -0,0 +1,76 @@
+#include "Logger.hpp"
+#include "state_hash.hpp"
+#include "physics/physics.hpp"
+#include "logic/logic.hpp"
+#include <cstring>
+
+/// FNV-1a, fed with 32 bit words instead of bytes
+struct StateHasher
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+
+    void add(uint32_t word)
+    {
+	hash = (hash ^ word) * 0x100000001b3ull;
+    }
+
+    void add(float value)
+    {
+	uint32_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	add(bits);
+    }
+};
+
+uint64_t hash_world_state(PhysicsWorld *physics, LogicWorld *logic)
+{
+    StateHasher hasher;
+    physics->bodies.iter().do_each([&](Body *body)
+    {
+	hasher.add(body->pos.x);
+	hasher.add(body->pos.y);
+	hasher.add(body->vel.x);
+	hasher.add(body->vel.y);
+	hasher.add(body->angle);
+	hasher.add(body->angle_vel);
+	hasher.add(body->mass);
+	hasher.add((uint32_t)body->fixed);
+    });
+    physics->attachments.iter().do_each([&](Attachment *attachment)
+    {
+	hasher.add(attachment->config.distance);
+    });
+    logic->cells.iter().do_each([&](Cell *cell)
+    {
+	hasher.add(cell->charge);
+	hasher.add(cell->life_time);
+	hasher.add(cell->neuron_next_update);
+	hasher.add((uint32_t)cell->attachments.size());
+    });
+    return hasher.hash;
+}
+
+bool open_hash_log(HashLog *log, const char *filename)
+{
+    log->file = fopen(filename, "w");
+    if (!log->file)
+    {
+	LOG_MSG("Cannot open ", filename, " for writing");
+	return false;
+    }
+    log->tick = 0;
+    return true;
+}
+
+void log_state_hash(HashLog *log, PhysicsWorld *physics, LogicWorld *logic)
+{
+    fprintf(log->file, "%llu %016llx\n", (unsigned long long)log->tick++,
+	    (unsigned long long)hash_world_state(physics, logic));
+}
+
+void close_hash_log(HashLog *log)
+{
+    if (log->file)
+	fclose(log->file);
+    log->file = 0;
+}
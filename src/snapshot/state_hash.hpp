@@ -0,0 +1,26 @@
+#ifndef STATE_HASH_HPP_INCLUDED
+#define STATE_HASH_HPP_INCLUDED
+
+#include <cstdint>
+#include <cstdio>
+
+/// Hash of the exact bits of the simulated state: all bodies (slot order)
+/// and all cells (slot order). Two runs with equal hashes are (very likely)
+/// bit identical. Cheap enough to be computed every tick.
+/// Equal across machines too, as the simulation takes no math functions from
+/// libm (-> det_math.hpp) and is compiled without contraction (-> Makefile).
+uint64_t hash_world_state(struct PhysicsWorld *physics, struct LogicWorld *logic);
+
+/// Text log of one state hash per tick: "<tick> <hash in hex>\n".
+/// Compare two logs with tools/compare_hashes.
+struct HashLog
+{
+    FILE *file = 0;
+    uint64_t tick = 0;
+};
+
+bool open_hash_log(HashLog *log, const char *filename);
+void log_state_hash(HashLog *log, struct PhysicsWorld *physics, struct LogicWorld *logic);
+void close_hash_log(HashLog *log);
+
+#endif
@@ -0,0 +1,216 @@
+#ifndef CONCURRENT_SLOTS_HPP_INCLUDED
+#define CONCURRENT_SLOTS_HPP_INCLUDED
+
+#include <algorithm>
+#include <atomic>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+
+/// A slot of ConcurrentSlots. Its address stays the same while it is in use.
+template <typename T>
+class ConcurrentSlot
+{
+private:
+    template <typename, size_t> friend class ConcurrentSlots;
+
+    enum State : uint8_t
+    {
+	FREE,
+	/// added, not visible to the iterators before the next publish()
+	PENDING,
+	LIVE,
+	/// removed, not visible to the iterators any more, reused after the next publish()
+	RELEASED,
+    };
+
+    T value_;
+    std::atomic<uint8_t> state_{FREE};
+    /// times the slot was added to, tells apart the values that used it in turn
+    uint32_t generation_ = 0;
+
+public:
+    T &value()
+    {
+	return value_;
+    }
+    T const &value() const
+    {
+	return value_;
+    }
+    T &assert_value()
+    {
+	assert(state_.load(std::memory_order_relaxed) != FREE);
+	return value_;
+    }
+    T const &assert_value() const
+    {
+	assert(state_.load(std::memory_order_relaxed) != FREE);
+	return value_;
+    }
+    uint32_t generation() const
+    {
+	return generation_;
+    }
+};
+
+/// Fixed capacity slots like Slots of slots.hpp, whose add() and remove() are
+/// lock free and can be called from many threads at once.
+/// A slot is taken from the free list of the last publish() or, when that is
+/// used up, by bumping the end of the used slots, both with one atomic operation.
+/// Added slots are only published to the iterators by publish(), removed ones
+/// are hidden from them at once but only reused after publish(), so that a
+/// thread can iterate while others add and remove, and no thread ever sees a
+/// slot that is being filled or refilled.
+/// publish() must not run concurrently with anything else, e.g. at the end of
+/// a parallel pass. The iteration is in slot order, and a single thread gets
+/// the lowest free slots first, as with Slots; with several threads adding,
+/// which thread gets which slot depends on the scheduling.
+template <typename T, size_t N>
+class ConcurrentSlots
+{
+private:
+    ConcurrentSlot<T> slots_[N];
+    /// slots below it have been used, may be above N when it ran full
+    std::atomic<size_t> end_{0};
+    /// free slot indices, the lowest at the top, only written by publish()
+    size_t free_[N];
+    std::atomic<size_t> free_count_{0};
+    /// slots added and removed since the last publish()
+    size_t added_[N], released_[N];
+    std::atomic<size_t> added_count_{0}, released_count_{0};
+
+    /// Visit the slots in the given state up to the end, in slot order
+    template <typename F>
+    void visit(typename ConcurrentSlot<T>::State state, F f)
+    {
+	size_t end = std::min(end_.load(std::memory_order_acquire), N);
+	for (size_t i = 0; i != end; ++i)
+	    if (slots_[i].state_.load(std::memory_order_acquire) == state)
+		f(&slots_[i]);
+    }
+
+public:
+    ConcurrentSlots() {}
+    ConcurrentSlots(ConcurrentSlots const &) = delete;
+    ConcurrentSlots &operator =(ConcurrentSlots const &) = delete;
+
+    /// Copy the value into a free slot, nullptr if there is none.
+    /// The slot is only iterated after the next publish().
+    ConcurrentSlot<T> *add(T const &value)
+    {
+	size_t index;
+	size_t count = free_count_.load(std::memory_order_relaxed);
+	// only popped between two publish(), so no index comes back while popping
+	while (count > 0 && !free_count_.compare_exchange_weak(count, count - 1, std::memory_order_relaxed))
+	    ;
+	if (count > 0)
+	    index = free_[count - 1];
+	else
+	{
+	    index = end_.fetch_add(1, std::memory_order_relaxed);
+	    if (index >= N)
+		return nullptr;
+	}
+	ConcurrentSlot<T> *slot = &slots_[index];
+	slot->value_ = value;
+	slot->generation_++;
+	slot->state_.store(ConcurrentSlot<T>::PENDING, std::memory_order_release);
+	added_[added_count_.fetch_add(1, std::memory_order_relaxed)] = index;
+	return slot;
+    }
+
+    /// Hide the slot from the iterators, it is reused after the next publish()
+    void remove(ConcurrentSlot<T> *slot)
+    {
+	assert(slot->state_.load(std::memory_order_relaxed) == ConcurrentSlot<T>::PENDING
+	       || slot->state_.load(std::memory_order_relaxed) == ConcurrentSlot<T>::LIVE);
+	slot->state_.store(ConcurrentSlot<T>::RELEASED, std::memory_order_release);
+	released_[released_count_.fetch_add(1, std::memory_order_relaxed)] = slot - slots_;
+    }
+
+    /// Make the added slots visible and the removed ones free. Not thread safe.
+    /// release is called with the value of every removed slot before the slot is
+    /// freed, to drop what still refers to it.
+    template <typename F>
+    void publish(F release)
+    {
+	size_t added = added_count_.load(std::memory_order_relaxed);
+	for (size_t i = 0; i != added; ++i)
+	{
+	    std::atomic<uint8_t> &state = slots_[added_[i]].state_;
+	    if (state.load(std::memory_order_relaxed) == ConcurrentSlot<T>::PENDING)
+		state.store(ConcurrentSlot<T>::LIVE, std::memory_order_relaxed);
+	}
+	size_t released = released_count_.load(std::memory_order_relaxed);
+	size_t count = free_count_.load(std::memory_order_relaxed);
+	for (size_t i = 0; i != released; ++i)
+	{
+	    release(&slots_[released_[i]].value_);
+	    slots_[released_[i]].state_.store(ConcurrentSlot<T>::FREE, std::memory_order_relaxed);
+	    free_[count++] = released_[i];
+	}
+	if (released)
+	    std::sort(free_, free_ + count, [](size_t a, size_t b) {return a > b;});
+	free_count_.store(count, std::memory_order_relaxed);
+	added_count_.store(0, std::memory_order_relaxed);
+	released_count_.store(0, std::memory_order_relaxed);
+	if (end_.load(std::memory_order_relaxed) > N)
+	    end_.store(N, std::memory_order_relaxed);
+    }
+    void publish()
+    {
+	publish([](T *) {});
+    }
+
+    /// Position of the slot, below N. With the generation of the slot, it
+    /// identifies a value for as long as the slots exist.
+    size_t index_of(ConcurrentSlot<T> const *slot) const
+    {
+	return slot - slots_;
+    }
+
+    /// Call f with every published slot, in slot order
+    template <typename F>
+    void for_each_slot(F f)
+    {
+	visit(ConcurrentSlot<T>::LIVE, f);
+    }
+
+    /// Call f with the value of every published slot, in slot order
+    template <typename F>
+    void for_each(F f)
+    {
+	visit(ConcurrentSlot<T>::LIVE, [&](ConcurrentSlot<T> *slot) {f(&slot->value_);});
+    }
+
+    /// For the callers of Slots: slots.iter().do_each(f) and slots.iter_nonempty_slots().do_each(f)
+    struct ValueRange
+    {
+	ConcurrentSlots *slots;
+	template <typename F>
+	void do_each(F f) const
+	{
+	    slots->for_each(f);
+	}
+    };
+    struct SlotRange
+    {
+	ConcurrentSlots *slots;
+	template <typename F>
+	void do_each(F f) const
+	{
+	    slots->for_each_slot(f);
+	}
+    };
+    ValueRange iter()
+    {
+	return ValueRange{this};
+    }
+    SlotRange iter_nonempty_slots()
+    {
+	return SlotRange{this};
+    }
+};
+
+#endif
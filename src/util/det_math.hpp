@@ -0,0 +1,105 @@
+#ifndef DET_MATH_HPP_INCLUDED
+#define DET_MATH_HPP_INCLUDED
+
+#include <cmath>
+
+/// exp, log, pow, sin and cos of our own, for the simulation.
+///
+/// The ones of libm differ in their last bits between libm builds and between
+/// their vectorized and scalar variants, which makes the state hashes
+/// (-> state_hash.hpp) differ between machines. These only use additions,
+/// multiplications, divisions, floor and exact power of two scaling, which
+/// IEEE 754 pins down, so (compiled with -ffp-contract=off) they give the same
+/// bits everywhere. They are within a few ulp of the exact result in double,
+/// far below the float precision of the world.
+
+/// e^x
+inline double det_exp(double x)
+{
+    if (x > 709)
+	return INFINITY;
+    if (x < -745)
+	return 0;
+    // x = k ln 2 + r, |r| <= ln 2 / 2, ln 2 split so that k ln2_hi is exact
+    double const ln2_hi = 6.93147180369123816490e-01, ln2_lo = 1.90821492927058770002e-10;
+    double k = floor(x * 1.44269504088896338700 + 0.5);
+    double r = (x - k * ln2_hi) - k * ln2_lo;
+    // Taylor series, the 14th term is below 2^-53 for |r| <= ln 2 / 2
+    double sum = 1, term = 1;
+    for (int i = 1; i != 14; ++i)
+    {
+	term*= r / i;
+	sum+= term;
+    }
+    return ldexp(sum, (int)k);
+}
+
+/// Natural logarithm, x > 0
+inline double det_log(double x)
+{
+    if (!(x > 0))
+	return x == 0 ? -INFINITY : NAN;
+    if (x == INFINITY)
+	return x;
+    // x = m 2^e, sqrt(1/2) <= m < sqrt(2)
+    int e;
+    double m = frexp(x, &e);
+    if (m < 0.70710678118654752440)
+    {
+	m*= 2;
+	--e;
+    }
+    // log m = 2 atanh(s) = 2 (s + s^3 / 3 + s^5 / 5 + ...), |s| < 0.18
+    double s = (m - 1) / (m + 1), s2 = s * s;
+    double sum = 0, power = s;
+    for (int i = 1; i != 25; i+= 2)
+    {
+	sum+= power / i;
+	power*= s2;
+    }
+    double const ln2_hi = 6.93147180369123816490e-01, ln2_lo = 1.90821492927058770002e-10;
+    return e * ln2_hi + (2 * sum + e * ln2_lo);
+}
+
+/// base^exponent, base > 0
+inline double det_pow(double base, double exponent)
+{
+    return det_exp(exponent * det_log(base));
+}
+
+/// sin(r) or cos(r) for |r| <= pi / 4
+inline double det_sin_cos_reduced(double r, bool cosine)
+{
+    double r2 = r * r;
+    double sum = cosine ? 1 : r, term = sum;
+    for (int i = cosine ? 1 : 2; i < 20; i+= 2)
+    {
+	term*= -r2 / (i * (i + 1));
+	sum+= term;
+    }
+    return sum;
+}
+
+/// sin(x) or cos(x). The reduction loses precision for huge x, the same way everywhere.
+inline double det_sin_cos(double x, bool cosine)
+{
+    // x = k pi / 2 + r, pi / 2 split so that k pio2_hi is exact for |k| < 2^20
+    double const pio2_hi = 1.57079632673412561417e+00, pio2_lo = 6.07710050650619224932e-11;
+    double k = floor(x * 6.36619772367581382433e-01 + 0.5);
+    double r = (x - k * pio2_hi) - k * pio2_lo;
+    int quadrant = (int)(k - 4 * floor(k / 4)) + (cosine ? 1 : 0);
+    double value = det_sin_cos_reduced(r, quadrant % 2 == 1);
+    return quadrant % 4 >= 2 ? -value : value;
+}
+
+inline double det_sin(double x)
+{
+    return det_sin_cos(x, false);
+}
+
+inline double det_cos(double x)
+{
+    return det_sin_cos(x, true);
+}
+
+#endif
@@ -0,0 +1,250 @@
+#ifndef SMALL_VECTOR_HPP_INCLUDED
+#define SMALL_VECTOR_HPP_INCLUDED
+
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <utility>
+
+/// Recycling pool for the out-of-line storage of SmallVectors.
+/// Blocks are binned by their power-of-two size; released blocks are linked
+/// into the free list of their bin (the link is stored inside the block).
+/// Memory is only given back when the arena is destroyed,
+/// thus the arena has to outlive every SmallVector that uses it.
+/// Not thread safe: one arena per world.
+struct SmallVectorArena
+{
+    static constexpr size_t MIN_BLOCK = 16;
+    static constexpr size_t BINS = 48;
+    static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+    struct FreeBlock
+    {
+	FreeBlock *next;
+    };
+
+    FreeBlock *free_blocks[BINS] = {};
+    /// All chunks, linked through their first bytes
+    void *chunks = nullptr;
+    char *chunk_pos = nullptr, *chunk_end = nullptr;
+
+    SmallVectorArena() {}
+    SmallVectorArena(SmallVectorArena const &) = delete;
+    SmallVectorArena &operator =(SmallVectorArena const &) = delete;
+
+    ~SmallVectorArena()
+    {
+	while (chunks)
+	{
+	    void *next = *(void **)chunks;
+	    ::operator delete(chunks);
+	    chunks = next;
+	}
+    }
+
+    /// The bin whose blocks can hold the given number of bytes
+    static size_t bin(size_t bytes)
+    {
+	size_t b = 0;
+	while ((MIN_BLOCK << b) < bytes)
+	    ++b;
+	assert(b < BINS);
+	return b;
+    }
+
+    static size_t block_size(size_t bin)
+    {
+	return MIN_BLOCK << bin;
+    }
+
+    void *allocate(size_t bytes)
+    {
+	size_t b = bin(bytes);
+	if (free_blocks[b])
+	{
+	    FreeBlock *block = free_blocks[b];
+	    free_blocks[b] = block->next;
+	    return block;
+	}
+
+	size_t size = block_size(b);
+	if ((size_t)(chunk_end - chunk_pos) < size)
+	{
+	    // the rest of the current chunk is wasted, it is small compared to the chunk
+	    size_t chunk_size = size > CHUNK_SIZE ? size : CHUNK_SIZE;
+	    char *chunk = (char *)::operator new(MIN_BLOCK + chunk_size);
+	    *(void **)chunk = chunks;
+	    chunks = chunk;
+	    chunk_pos = chunk + MIN_BLOCK;
+	    chunk_end = chunk_pos + chunk_size;
+	}
+	void *block = chunk_pos;
+	chunk_pos+= size;
+	return block;
+    }
+
+    void release(void *ptr, size_t bytes)
+    {
+	size_t b = bin(bytes);
+	FreeBlock *block = (FreeBlock *)ptr;
+	block->next = free_blocks[b];
+	free_blocks[b] = block;
+    }
+};
+
+/// A vector that holds up to N elements inline, without allocation.
+/// When it grows beyond that, the elements are moved to a block of its arena,
+/// or of the heap if no arena is given.
+/// The arena is carried along on copies.
+template <typename T, size_t N>
+class SmallVector
+{
+private:
+    T *data_;
+    size_t size_;
+    size_t capacity_;
+    SmallVectorArena *arena_;
+    alignas(T) unsigned char inline_storage_[N * sizeof(T)];
+
+    T *inline_data()
+    {
+	return reinterpret_cast<T *>(inline_storage_);
+    }
+
+    bool is_inline() const
+    {
+	return data_ == reinterpret_cast<T const *>(inline_storage_);
+    }
+
+    T *allocate(size_t capacity)
+    {
+	if (arena_)
+	    return (T *)arena_->allocate(capacity * sizeof(T));
+	return (T *)::operator new(capacity * sizeof(T));
+    }
+
+    void deallocate()
+    {
+	if (is_inline())
+	    return;
+	if (arena_)
+	    arena_->release(data_, capacity_ * sizeof(T));
+	else
+	    ::operator delete(data_);
+	data_ = inline_data();
+	capacity_ = N;
+    }
+
+    void copy_from(SmallVector const &src)
+    {
+	reserve(src.size_);
+	for (size_t i = 0; i != src.size_; ++i)
+	    new (&data_[i]) T(src.data_[i]);
+	size_ = src.size_;
+    }
+
+public:
+    SmallVector()
+	: SmallVector(nullptr)
+    {
+    }
+
+    explicit SmallVector(SmallVectorArena *arena)
+	: data_(inline_data()), size_(0), capacity_(N), arena_(arena)
+    {
+    }
+
+    SmallVector(SmallVector const &src)
+	: SmallVector(src.arena_)
+    {
+	copy_from(src);
+    }
+
+    SmallVector &operator =(SmallVector const &rhs)
+    {
+	if (this == &rhs)
+	    return *this;
+	clear();
+	if (arena_ != rhs.arena_)
+	{
+	    deallocate();
+	    arena_ = rhs.arena_;
+	}
+	copy_from(rhs);
+	return *this;
+    }
+
+    ~SmallVector()
+    {
+	clear();
+	deallocate();
+    }
+
+    /// Only allowed while no element is stored out of line
+    void set_arena(SmallVectorArena *arena)
+    {
+	assert(is_inline());
+	arena_ = arena;
+    }
+
+    void reserve(size_t capacity)
+    {
+	if (capacity <= capacity_)
+	    return;
+	size_t new_capacity = capacity_ * 2;
+	if (new_capacity < capacity)
+	    new_capacity = capacity;
+	T *new_data = allocate(new_capacity);
+	for (size_t i = 0; i != size_; ++i)
+	{
+	    new (&new_data[i]) T(std::move(data_[i]));
+	    data_[i].~T();
+	}
+	deallocate();
+	data_ = new_data;
+	capacity_ = new_capacity;
+    }
+
+    void push_back(T const &value)
+    {
+	if (size_ == capacity_)
+	{
+	    // value might live in this vector
+	    T copy = value;
+	    reserve(size_ + 1);
+	    new (&data_[size_]) T(std::move(copy));
+	}
+	else
+	    new (&data_[size_]) T(value);
+	++size_;
+    }
+
+    void pop_back()
+    {
+	assert(size_ > 0);
+	data_[--size_].~T();
+    }
+
+    void clear()
+    {
+	for (size_t i = 0; i != size_; ++i)
+	    data_[i].~T();
+	size_ = 0;
+    }
+
+    size_t size() const { return size_; }
+    bool empty() const { return size_ == 0; }
+    size_t capacity() const { return capacity_; }
+
+    T &operator [](size_t i) { assert(i < size_); return data_[i]; }
+    T const &operator [](size_t i) const { assert(i < size_); return data_[i]; }
+    T &back() { assert(size_ > 0); return data_[size_ - 1]; }
+
+    T *begin() { return data_; }
+    T *end() { return data_ + size_; }
+    T const *begin() const { return data_; }
+    T const *end() const { return data_ + size_; }
+};
+
+#endif
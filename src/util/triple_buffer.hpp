@@ -0,0 +1,62 @@
+#ifndef TRIPLE_BUFFER_HPP_INCLUDED
+#define TRIPLE_BUFFER_HPP_INCLUDED
+
+#include <atomic>
+#include <cstdint>
+
+/// Lock free hand-over of values from one producer thread to one consumer thread.
+/// The producer fills the back buffer and publishes it, which swaps it with the middle one.
+/// The consumer swaps the front buffer with the middle one if a new value was published.
+/// Neither side ever waits for the other: the producer overwrites
+/// a published but unconsumed value, the consumer keeps reading its last value.
+/// The buffers are reused, so a T holding vectors stops allocating once they are big enough.
+template <typename T>
+class TripleBuffer
+{
+private:
+    /// set in middle_ when the middle buffer holds a value the consumer has not seen
+    static constexpr uint8_t FRESH = 4;
+    static constexpr uint8_t INDEX = 3;
+
+    T buffers_[3];
+    /// index of the middle buffer | FRESH
+    std::atomic<uint8_t> middle_{1};
+    /// owned by the producer
+    uint8_t back_ = 0;
+    /// owned by the consumer
+    uint8_t front_ = 2;
+
+public:
+    TripleBuffer() {}
+    TripleBuffer(TripleBuffer const &) = delete;
+    TripleBuffer &operator =(TripleBuffer const &) = delete;
+
+    /// Producer: the buffer to fill, it still holds an older value
+    T &write_buffer()
+    {
+	return buffers_[back_];
+    }
+
+    /// Producer: hand the write buffer over to the consumer
+    void publish()
+    {
+	back_ = middle_.exchange(back_ | FRESH, std::memory_order_acq_rel) & INDEX;
+    }
+
+    /// Consumer: switch to the latest published value, false if there is none since the last call
+    bool update()
+    {
+	if (!(middle_.load(std::memory_order_relaxed) & FRESH))
+	    return false;
+	front_ = middle_.exchange(front_, std::memory_order_acq_rel) & INDEX;
+	return true;
+    }
+
+    /// Consumer: the latest value as of the last update()
+    T const &read_buffer() const
+    {
+	return buffers_[front_];
+    }
+};
+
+#endif
@@ -0,0 +1,144 @@
+/// Compares the broadphases (-> BroadphaseKind in src/physics/physics.hpp)
+/// on the same scenarios: every scenario is run once per broadphase from the
+/// same start, the time of the physics steps and the pairs are reported.
+/// Usage: bench_broadphase [STEPS]
+
+#include "physics/physics.hpp"
+#include "logic/logic.hpp"
+#include "profiler/profiler.hpp"
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <vector>
+
+struct Scenario
+{
+    const char *name;
+    bool periodic;
+    /// grow the organisms of init_logic_world(), instead of bodies only
+    bool organisms;
+    /// bodies placed uniformly in the box from min to max, their radii are
+    /// log-uniform between min_radius and max_radius
+    int body_count;
+    glm::vec2 min, max;
+    float min_radius, max_radius;
+    /// some of the bodies large, from large_radius / 2 to large_radius
+    int large_count;
+    float large_radius;
+};
+
+Scenario const scenarios[] = {
+    // name       periodic organisms  bodies  box                                   radii       large
+    {"organisms", false, true,   0,   glm::vec2(0, 0), glm::vec2(0, 0),     0, 0,       0, 0},
+    {"uniform",   false, false,  480, glm::vec2(0, 0), glm::vec2(100, 100), 0.3, 1.5,   0, 0},
+    {"cluster",   false, false,  480, glm::vec2(40, 40), glm::vec2(60, 60), 0.3, 1,     0, 0},
+    {"wall",      false, false,  480, glm::vec2(0, 0), glm::vec2(5, 100),   0.3, 1,     0, 0},
+    {"mixed",     false, false,  460, glm::vec2(0, 0), glm::vec2(100, 100), 0.2, 0.8,   20, 8},
+    {"periodic",  true,  false,  480, glm::vec2(0, 0), glm::vec2(100, 100), 0.3, 1.5,   0, 0},
+};
+
+struct BenchResult
+{
+    double mean_us, p99_us;
+    double candidate_pairs, force_pairs;
+    size_t first_force_pairs;
+};
+
+void add_bodies(PhysicsWorld *physics, Scenario const &scenario, std::mt19937 *random)
+{
+    std::uniform_real_distribution<float> unit(0, 1);
+    for (int i = 0; i != scenario.body_count; ++i)
+    {
+	Body body = Body();
+	body.pos = scenario.min + (scenario.max - scenario.min) * glm::vec2(unit(*random), unit(*random));
+	body.mass_per_radius = 1;
+	if (i < scenario.large_count)
+	    body.mass = scenario.large_radius * (0.5f + 0.5f * unit(*random));
+	else
+	    body.mass = scenario.min_radius
+		* powf(scenario.max_radius / scenario.min_radius, unit(*random));
+	physics->bodies.add(body);
+    }
+    publish_bodies(physics);
+}
+
+BenchResult run_scenario(Scenario const &scenario, BroadphaseKind kind, int steps)
+{
+    // the worlds are big, keep them off the stack
+    std::unique_ptr<PhysicsWorld> physics(new PhysicsWorld());
+    std::unique_ptr<LogicWorld> logic(new LogicWorld());
+    physics->periodic = scenario.periodic;
+    physics->broadphase = kind;
+    init_physics(physics.get());
+    std::mt19937 random(1);
+    if (scenario.organisms)
+	init_logic_world(logic.get(), physics.get());
+    else
+	add_bodies(physics.get(), scenario, &random);
+    update_broadphase(physics.get());
+
+    float const elapsed_time = 1 / 30.f;
+    std::vector<uint64_t> durations;
+    BenchResult result = BenchResult();
+    for (int step = 0; step != steps; ++step)
+    {
+	if (scenario.organisms)
+	    update_logic(logic.get(), physics.get(), elapsed_time);
+	uint64_t start = profile_now();
+	update_physics(physics.get(), elapsed_time);
+	durations.push_back(profile_now() - start);
+	result.candidate_pairs+= physics->telemetry.candidate_pairs;
+	result.force_pairs+= physics->telemetry.force_pairs;
+	if (step == 0)
+	    result.first_force_pairs = physics->telemetry.force_pairs;
+    }
+
+    double sum = 0;
+    for (uint64_t duration : durations)
+	sum+= duration;
+    std::sort(durations.begin(), durations.end());
+    result.mean_us = sum / steps / 1000;
+    result.p99_us = durations[(steps - 1) * 99 / 100] / 1000.;
+    result.candidate_pairs/= steps;
+    result.force_pairs/= steps;
+    return result;
+}
+
+int main(int argc, char **argv)
+{
+    int steps = argc > 1 ? atoi(argv[1]) : 1000;
+    if (argc > 2 || steps <= 0)
+    {
+	fprintf(stderr, "usage: %s [STEPS]\n", argv[0]);
+	return 2;
+    }
+
+    BroadphaseKind const kinds[] = {BROADPHASE_GRID, BROADPHASE_SWEEP_AND_PRUNE};
+    printf("%d steps, physics step times; pairs per step\n", steps);
+    printf("%-10s %-6s %10s %10s %12s %10s\n", "scenario", "broad", "mean us", "p99 us",
+	   "candidates", "contacts");
+    int status = 0;
+    for (Scenario const &scenario : scenarios)
+    {
+	size_t first_force_pairs = 0;
+	for (BroadphaseKind kind : kinds)
+	{
+	    BenchResult result = run_scenario(scenario, kind, steps);
+	    printf("%-10s %-6s %10.1f %10.1f %12.1f %10.1f\n", scenario.name, broadphase_name(kind),
+		   result.mean_us, result.p99_us, result.candidate_pairs, result.force_pairs);
+	    // the worlds only drift apart by the order of the forces, the first step
+	    // starts from the same bodies, so every broadphase has to find the same contacts
+	    if (kind == kinds[0])
+		first_force_pairs = result.first_force_pairs;
+	    else if (result.first_force_pairs != first_force_pairs)
+	    {
+		printf("%-10s contacts of the first step differ: %zu, %zu\n", "", first_force_pairs,
+		       result.first_force_pairs);
+		status = 1;
+	    }
+	}
+    }
+    return status;
+}
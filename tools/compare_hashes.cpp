@@ -0,0 +1,60 @@
+/// Compares two state hash logs (-> src/snapshot/state_hash.hpp),
+/// e.g. of a serial reference run and a parallel run,
+/// and reports the first tick where they diverge.
+/// Exit code: 0 identical, 1 diverged, 2 usage/io error.
+
+#include <cstdio>
+#include <cstring>
+
+int main(int argc, char **argv)
+{
+    if (argc != 3)
+    {
+	fprintf(stderr, "usage: %s REFERENCE_LOG OTHER_LOG\n", argv[0]);
+	return 2;
+    }
+
+    FILE *files[2];
+    for (int i = 0; i != 2; ++i)
+    {
+	files[i] = fopen(argv[i + 1], "r");
+	if (!files[i])
+	{
+	    fprintf(stderr, "cannot open %s\n", argv[i + 1]);
+	    return 2;
+	}
+    }
+
+    unsigned long long ticks = 0;
+    for (;;)
+    {
+	unsigned long long tick[2], hash[2];
+	bool read[2];
+	for (int i = 0; i != 2; ++i)
+	    read[i] = fscanf(files[i], "%llu %llx", &tick[i], &hash[i]) == 2;
+
+	if (!read[0] && !read[1])
+	    break;
+	if (read[0] != read[1])
+	{
+	    printf("logs have different lengths: %s ends after tick %llu\n",
+		   argv[read[0] ? 2 : 1], ticks);
+	    return 1;
+	}
+	if (tick[0] != tick[1])
+	{
+	    printf("logs are out of step: tick %llu vs %llu\n", tick[0], tick[1]);
+	    return 1;
+	}
+	if (hash[0] != hash[1])
+	{
+	    printf("diverged at tick %llu: %016llx (%s) vs %016llx (%s)\n",
+		   tick[0], hash[0], argv[1], hash[1], argv[2]);
+	    return 1;
+	}
+	++ticks;
+    }
+
+    printf("identical for %llu ticks\n", ticks);
+    return 0;
+}